@@ -0,0 +1,287 @@
+#pragma once
+#include "task.h"
+
+#include <memory>
+
+namespace Task
+{
+// broad phase used to find pairs of triangles to be checked
+enum class Engine
+{
+    BruteForce,              // check all N*(N-1)/2 pairs
+    TiledBruteForce,         // check all pairs tile by tile, cache friendly, the best one for dense scenes
+    UniformGrid,             // check only pairs sharing a cell of the uniform grid
+    SweepAndPrune,           // check only pairs overlapping along the axis of the larger spread
+    BoundingVolumeHierarchy, // check only pairs from the leaves of the tree with intersecting boxes,
+                             // the best one for triangles of very different sizes
+    HierarchicalGrid,        // check only pairs from the nearby cells of the grids of the sizes of the triangles,
+                             // a triangle is stored once, on the grid fitting its size
+    Automatic,               // one of the above chosen by a sampling pass over the triangles (see SceneEstimate),
+                             // used by checkIntersections(in_triangles, out_count)
+};
+
+// numbers of the pairs passed to the pair check, and of the ones rejected by its stages
+// (the stages go in this order, the rest of the checked pairs are intersected)
+struct PairCheckStats
+{
+    size_t checked = 0;
+    size_t rejected_by_bounding_boxes = 0;
+    size_t rejected_by_first_triangle = 0;  // by the normals of the sides of the first triangle
+    size_t rejected_by_second_triangle = 0; // by the normals of the sides of the second triangle
+
+    // not passed to the pair check: separated by the same side as in the previous call (CoherenceState only)
+    size_t skipped_by_cached_side = 0;
+
+    // not passed to the pair check: intersected, as one of the triangles lies in a cell of the uniform grid
+    // inside the other one (UniformGrid only, when only the numbers of the intersections are asked for)
+    size_t counted_by_covered_cells = 0;
+};
+
+// what the sampling pass of Engine::Automatic learned about the scene
+struct SceneEstimate
+{
+    // average number of the triangles whose bounding boxes intersect the box of a triangle
+    float overlap_degree = 0;
+
+    // size of the large triangles (the 95th percentile) to the median size, by the larger sides of their boxes
+    float size_spread = 1;
+};
+
+// details of a checkIntersections call
+struct Stats
+{
+    // time each of the worker threads spent on the checks, in seconds
+    std::vector<double> threads_busy_time;
+    PairCheckStats pairs;
+
+    Engine engine = Engine::Automatic; // the engine which did the checks, never Automatic after a call
+    SceneEstimate scene;               // filled only if the engine was chosen automatically
+};
+
+// same as checkIntersections(in_triangles, out_count), with an explicitly chosen engine
+void checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count, Engine engine);
+
+// same as above, also fills the stats
+void checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count, Engine engine,
+    Stats& stats);
+
+// intersected triangles in compressed sparse row form:
+// the triangles intersecting the triangle i are neighbours[offsets[i]..offsets[i + 1]), in ascending order
+struct Adjacency
+{
+    std::vector<size_t> offsets; // the number of the triangles + 1
+    std::vector<int> neighbours; // every pair is there twice, for both triangles
+};
+
+// same as checkIntersections(in_triangles, out_count, engine), gives the intersected triangles themselves
+// the numbers of the intersections are offsets[i + 1] - offsets[i]
+void checkIntersections(const std::vector<Triangle>& in_triangles, Adjacency& out_adjacency,
+    Engine engine = Engine::Automatic);
+
+// same as checkIntersections(in_triangles, out_count, engine), but out_count[i] is limited by max_count:
+// min(the number of the intersections of the triangle i, max_count),
+// e.g. max_count = 1 tells whether the triangle intersects anything
+// the pairs of the triangles already having max_count intersections are not checked,
+// so dense scenes take much less work
+// max_count must be positive
+void checkIntersectionsUpTo(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count, int max_count,
+    Engine engine = Engine::Automatic);
+
+// same as checkIntersections(in_triangles, out_count, engine), but the pairs are checked exactly:
+// two triangles intersect if and only if they have at least one common point,
+// even if it's a shared vertex or a point of touching sides, whatever the rounding of the float check
+// the projections are still evaluated in float, only the ones within the rounding error from the borders
+// of the shadows are recalculated exactly, so it's about as fast as the scalar float check (not the vectorized one)
+void checkIntersectionsExactly(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    Engine engine = Engine::Automatic);
+
+// how checkIntersectionsOnGrid mapped the coordinates to integers:
+// (x - origin_x) / step and (y - origin_y) / step, from 0 to 2^(bits - 1) - 1
+struct GridQuantization
+{
+    float step = 0;          // the largest power of 2 all the coordinates are multiples of
+    float origin_x = 0;      // the smallest coordinates
+    float origin_y = 0;
+    int bits = 0;            // 16 if the integers fit into int16, 32 otherwise
+    const char* kernel = ""; // name of the pair kernel which did the checks, not wider than getPairKernelName()
+};
+
+// same as checkIntersectionsExactly, for the coordinates on a grid (e.g. snapped ones):
+// they are mapped to integers losslessly and the pairs are checked in integer arithmetic,
+// so the results are exact and the same on every machine
+// the projections are calculated in int32 lanes if the integers fit into int16
+// (as many pairs at once as the float check), in int64 lanes otherwise (half as many)
+// returns false and checks nothing if the integers don't fit into int32 (the triangles span more than 2^31 - 1 steps
+// along an axis) or the coordinates are not finite
+bool checkIntersectionsOnGrid(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    GridQuantization& out_quantization, Engine engine = Engine::Automatic);
+
+// estimated number of the intersections of a triangle with the bounds of its 95% confidence interval
+struct CountEstimate
+{
+    float count;
+    float lower;
+    float upper;
+};
+
+// estimates the numbers of the intersections from samples of the candidates of every triangle,
+// checking no more than about samples_per_triangle pairs per triangle whatever the density of the scene
+// the triangles with fewer candidates get the exact numbers (count == lower == upper),
+// the width of the intervals of the rest falls as 1 / sqrt(samples_per_triangle)
+// it takes less time than checkIntersections only if the triangles have several times more candidates than samples
+// (e.g. 6 times, for dense scenes), otherwise all the triangles get the exact numbers from checkIntersections
+void estimateIntersections(const std::vector<Triangle>& in_triangles, std::vector<CountEstimate>& out_estimate,
+    size_t samples_per_triangle = 1024);
+
+// splits the triangles into groups connected by intersections (the components of the graph of intersections)
+// out_component[i] is the smallest index in the group of the triangle i
+// the pairs already known to be in the same group are not checked, so it's faster than finding all the pairs
+void findComponents(const std::vector<Triangle>& in_triangles, std::vector<int>& out_component,
+    Engine engine = Engine::Automatic);
+
+// what a call of checkIntersections(in_triangles, out_count, state) leaves to the next one:
+// the sorted intervals of sweep and prune and the sides which separated the checked pairs
+// if the triangles move a little from call to call (e.g. in the frames of a simulation),
+// the next call sorts the intervals by a few moves and checks most of the separated pairs by one side only
+class CoherenceState
+{
+public:
+    CoherenceState();
+    ~CoherenceState();
+
+    CoherenceState(const CoherenceState&) = delete;
+    CoherenceState& operator=(const CoherenceState&) = delete;
+
+    // the next call starts from scratch, it also does so if the number of the triangles changes
+    void reset();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+
+    friend void checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+        CoherenceState& state);
+    friend void checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+        CoherenceState& state, Stats& stats);
+};
+
+// same as checkIntersections(in_triangles, out_count) with sweep and prune, reusing the results of the previous call
+// the triangles must keep their indices from call to call
+void checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    CoherenceState& state);
+void checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    CoherenceState& state, Stats& stats);
+
+// threads for the checks, started at the first check and reused by the following ones
+// for the cases when checkIntersections is called often (e.g. every frame)
+class WorkerPool
+{
+public:
+    // threads_count = 0 means one thread per hardware thread
+    // if pin_threads is set, the thread k runs only on the core k (modulo the number of cores)
+    explicit WorkerPool(size_t threads_count = 0, bool pin_threads = false);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // process-wide pool with the default settings
+    static WorkerPool& getDefault();
+
+    size_t getThreadsCount() const;
+
+    // same as the free functions, calls from different threads are executed one after another
+    void checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+        Engine engine = Engine::Automatic);
+    void checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+        Engine engine, Stats& stats);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+
+    friend class IntersectionIndex;
+};
+
+// triangles with the numbers of their intersections kept up to date while the triangles are inserted, erased and moved
+// a change checks only the changed triangle against its neighbours, so its cost doesn't depend on the size of the scene
+class IntersectionScene
+{
+public:
+    // ids of the given triangles are their indices
+    explicit IntersectionScene(const std::vector<Triangle>& in_triangles = {});
+    ~IntersectionScene();
+
+    IntersectionScene(const IntersectionScene&) = delete;
+    IntersectionScene& operator=(const IntersectionScene&) = delete;
+
+    // returns the id of the new triangle, the ids of the erased triangles are reused
+    size_t insert(const Triangle& triangle);
+
+    // the id must be in the scene
+    void erase(size_t id);
+    void update(size_t id, const Triangle& triangle);
+
+    bool contains(size_t id) const;
+    const Triangle& getTriangle(size_t id) const;
+
+    // number of the triangles in the scene
+    size_t size() const;
+
+    int getIntersectionsCount(size_t id) const;
+
+    // numbers of the intersections by the ids, 0 for the ids not in the scene
+    const std::vector<int>& getIntersectionsCounts() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// set of triangles indexed once to be checked against batches of other triangles (queries),
+// e.g. probes against a static scene
+// a query is checked only against its neighbourhood in the set, not against the whole set,
+// and the queries are not checked against each other
+class IntersectionIndex
+{
+public:
+    // large builds and batches are shared by the threads of the pool, the pool must outlive the index
+    explicit IntersectionIndex(const std::vector<Triangle>& in_triangles,
+        WorkerPool& pool = WorkerPool::getDefault());
+    ~IntersectionIndex();
+
+    IntersectionIndex(const IntersectionIndex&) = delete;
+    IntersectionIndex& operator=(const IntersectionIndex&) = delete;
+
+    // number of the triangles in the set
+    size_t size() const;
+
+    // out_count[q] is the number of the triangles of the set intersecting queries[q]
+    // calls from different threads are executed one after another
+    void countIntersections(const std::vector<Triangle>& queries, std::vector<int>& out_count) const;
+
+    // same as above, but out_count[q] is limited by max_count, a query stops as soon as it has max_count intersections
+    // max_count must be positive
+    void countIntersections(const std::vector<Triangle>& queries, std::vector<int>& out_count, int max_count) const;
+
+    // same as the first one, out_set_count[i] is also set to the number of the queries
+    // intersecting the triangle i of the set
+    void countIntersections(const std::vector<Triangle>& queries, std::vector<int>& out_count,
+        std::vector<int>& out_set_count) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// numbers of the intersections between two sets of triangles (e.g. two layers), the pairs inside a set are not checked:
+// out_count_a[i] is the number of the triangles of b intersecting the triangle i of a, and vice versa
+// the smaller set is put into an IntersectionIndex on the default pool, and the larger one is checked against it
+void checkIntersections(const std::vector<Triangle>& in_triangles_a, const std::vector<Triangle>& in_triangles_b,
+    std::vector<int>& out_count_a, std::vector<int>& out_count_b);
+
+// name of the vectorized pair check used on this processor: "avx512", "avx2", "sse4.1" or "scalar"
+// the widest supported one is chosen at the first call,
+// a narrower one can be forced by the TASK_PAIR_KERNEL environment variable
+const char* getPairKernelName();
+}
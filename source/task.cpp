@@ -1,9 +1,50 @@
 #include "task.h"
+#include "intersections.h"
 
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <atomic>
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <bitset>
+#include <unordered_map>
+
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// code for instruction sets not enabled in the build flags, executed only after checking the processor
+// avx512f implies FMA, and GCC contracts a * b + c into it by default (-ffp-contract=fast),
+// so the contraction is turned off to keep the float operations of the scalar check
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#elif defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2"), optimize("fp-contract=off")))
+#define TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
 
 struct Vector2D
 {
@@ -48,6 +89,11 @@ class Shadow
     }
 
 public:
+    static Shadow fromBorders(float begin, float end)
+    {
+        return { begin, end };
+    }
+
     static Shadow fromProjectedPoints(float p1, float p2)
     {
         return {
@@ -68,6 +114,16 @@ public:
     {
         return (shadow1._begin <= shadow2._end) && (shadow1._end >= shadow2._begin);
     }
+
+    float getBegin() const
+    {
+        return _begin;
+    }
+
+    float getEnd() const
+    {
+        return _end;
+    }
 };
 
 // find shadows of tri1 and tri2, projected on the vector in tri1, and check if they intersect
@@ -120,6 +176,24 @@ bool areIntersectedRelativelyToFirstTriangle(const Triangle& tri1, const Triangl
 }
 
 
+// check if shadows of the triangles intersect when projected on the coordinate axes
+// normals of a degenerate triangle (all points on one line) don't separate it
+// from the triangles lying on the same line, but one of the axes does
+bool areIntersectedRelativelyToAxes(const Triangle& tri1, const Triangle& tri2)
+{
+    auto shadow_tri1_x = Shadow::fromProjectedPoints(tri1.a.x, tri1.b.x, tri1.c.x);
+    auto shadow_tri2_x = Shadow::fromProjectedPoints(tri2.a.x, tri2.b.x, tri2.c.x);
+    if (!Shadow::areIntersected(shadow_tri1_x, shadow_tri2_x))
+    {
+        return false;
+    }
+
+    auto shadow_tri1_y = Shadow::fromProjectedPoints(tri1.a.y, tri1.b.y, tri1.c.y);
+    auto shadow_tri2_y = Shadow::fromProjectedPoints(tri2.a.y, tri2.b.y, tri2.c.y);
+    return Shadow::areIntersected(shadow_tri1_y, shadow_tri2_y);
+}
+
+
 bool areIntersected(const Triangle& tri1, const Triangle& tri2)
 {
     if (!areIntersectedRelativelyToFirstTriangle(tri1, tri2))
@@ -132,87 +206,5778 @@ bool areIntersected(const Triangle& tri1, const Triangle& tri2)
         return false;
     }
 
+    if (!areIntersectedRelativelyToAxes(tri1, tri2))
+    {
+        return false;
+    }
+
     return true;
 }
 
 
-class IntersectionsChecker
+// exact sign of a sum of products of floats
+// a product of two floats is exact in double (24 + 24 bits of mantissa out of 53),
+// the products are summed up into an expansion: doubles of increasing magnitude, not overlapping by bits,
+// whose sum is exactly the sum of the products, so the largest of them has its sign (Shewchuk, 1997)
+class ExactSum
 {
+public:
+    static constexpr int max_products_count = 8;
+
+    // no more than max_products_count products
+    void addProduct(float a, float b)
+    {
+        double carry = static_cast<double>(a) * b;
+        int count = 0;
+        for (int k = 0; k < parts_count; ++k)
+        {
+            // carry + parts[k] == sum + error exactly
+            const double sum = carry + parts[k];
+            const double part_of_sum = sum - carry;
+            const double error = (carry - (sum - part_of_sum)) + (parts[k] - part_of_sum);
+            carry = sum;
+            if (error != 0)
+            {
+                parts[count++] = error;
+            }
+        }
+        if (carry != 0)
+        {
+            parts[count++] = carry;
+        }
+        parts_count = count;
+    }
+
+    int getSign() const
+    {
+        if (parts_count == 0)
+        {
+            return 0;
+        }
+        return parts[parts_count - 1] > 0 ? 1 : -1;
+    }
+
 private:
-    const std::vector<Triangle>& in_triangles;
-    std::vector<int>& out_count;
-    const size_t triangles_count;
-    std::vector<std::atomic<int>> out_count_atomic;
-    // std::mutex out_count_mutex;
+    double parts[max_products_count];
+    int parts_count = 0;
+};
+
+// sign of the cross product (b - a) x (q - c), exactly
+// it's evaluated in double first, only the results within the error bound of the evaluation
+// (the one of orient2d by Shewchuk) are summed up exactly, which happens only for almost touching triangles
+inline int getCrossProductSign(const Point& a, const Point& b, const Point& c, const Point& q)
+{
+    const double left = (static_cast<double>(b.x) - a.x) * (static_cast<double>(q.y) - c.y);
+    const double right = (static_cast<double>(b.y) - a.y) * (static_cast<double>(q.x) - c.x);
+    const double cross_product = left - right;
+
+    const double epsilon = std::numeric_limits<double>::epsilon() / 2;
+    const double error_bound = (3 + 16 * epsilon) * epsilon * (std::fabs(left) + std::fabs(right));
+    if (cross_product > error_bound)
+    {
+        return 1;
+    }
+    if (cross_product < -error_bound)
+    {
+        return -1;
+    }
 
-    void markIntersected(int i, int j)
+    // bx*qy - bx*cy - ax*qy + ax*cy - by*qx + by*cx + ay*qx - ay*cx
+    ExactSum sum;
+    sum.addProduct(b.x, q.y);
+    sum.addProduct(-b.x, c.y);
+    sum.addProduct(-a.x, q.y);
+    sum.addProduct(a.x, c.y);
+    sum.addProduct(-b.y, q.x);
+    sum.addProduct(b.y, c.x);
+    sum.addProduct(a.y, q.x);
+    sum.addProduct(-a.y, c.x);
+    return sum.getSign();
+}
+
+// same as areIntersectedRelativelyToSide, but exact:
+// the projection of a point q is the cross product (side_end - side_begin) x (q - side_begin),
+// so it's compared with 0 and with the projection of the last point by the signs of cross products
+// the shadows are separated if all the points of tri2 are below both of them or all are above both of them
+bool areIntersectedRelativelyToSideExactly(const Point& side_begin, const Point& side_end,
+    const Point& last_point_of_triangle, const Point (&tri2)[3])
+{
+    int below_count = 0;
+    int above_count = 0;
+    for (const auto& point : tri2)
     {
-        out_count_atomic[i]++;
-        out_count_atomic[j]++;
+        const int sign = getCrossProductSign(side_begin, side_end, side_begin, point);
+        if (sign == 0 || getCrossProductSign(side_begin, side_end, last_point_of_triangle, point) != sign)
+        {
+            // the point is in the shadow of tri1
+            return true;
+        }
+        if (sign < 0)
+        {
+            ++below_count;
+        }
+        else
+        {
+            ++above_count;
+        }
     }
+    return below_count > 0 && above_count > 0;
+}
 
-    void checkPortionOfTriangles(int num_of_portions, int current_portion)
+
+// axis-aligned bounding box of a triangle
+// triangles with disjoint boxes can't have a common point
+struct BoundingBox
+{
+    float min_x;
+    float min_y;
+    float max_x;
+    float max_y;
+
+    static BoundingBox fromTriangle(const Triangle& tri)
+    {
+        return {
+                std::min({tri.a.x, tri.b.x, tri.c.x}),
+                std::min({tri.a.y, tri.b.y, tri.c.y}),
+                std::max({tri.a.x, tri.b.x, tri.c.x}),
+                std::max({tri.a.y, tri.b.y, tri.c.y})
+        };
+    }
+
+    static bool areIntersected(const BoundingBox& box1, const BoundingBox& box2)
+    {
+        return (box1.min_x <= box2.max_x) && (box1.max_x >= box2.min_x) &&
+            (box1.min_y <= box2.max_y) && (box1.max_y >= box2.min_y);
+    }
+
+    static BoundingBox getUnion(const BoundingBox& box1, const BoundingBox& box2)
+    {
+        return {
+                std::min(box1.min_x, box2.min_x),
+                std::min(box1.min_y, box2.min_y),
+                std::max(box1.max_x, box2.max_x),
+                std::max(box1.max_y, box2.max_y)
+        };
+    }
+
+    float getHalfPerimeter() const
+    {
+        return (max_x - min_x) + (max_y - min_y);
+    }
+};
+
+
+// allocator for std::vector, aligning the data to the given boundary
+template<class T, size_t Alignment = 64>
+struct AlignedAllocator
+{
+    using value_type = T;
+
+    template<class U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template<class U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&)
+    {
+    }
+
+    // the pointer returned by operator new is stored right before the aligned block
+    T* allocate(size_t n)
+    {
+        void* block = ::operator new(n * sizeof(T) + Alignment);
+        auto address = (reinterpret_cast<uintptr_t>(block) + Alignment) & ~static_cast<uintptr_t>(Alignment - 1);
+        reinterpret_cast<void**>(address)[-1] = block;
+        return reinterpret_cast<T*>(address);
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        ::operator delete(reinterpret_cast<void**>(p)[-1]);
+    }
+
+    template<class U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const
+    {
+        return true;
+    }
+
+    template<class U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const
     {
-        auto portion_size = triangles_count / num_of_portions;
-        auto portion_begin = portion_size * current_portion;
-        auto portion_end = num_of_portions == current_portion + 1 ?
-            triangles_count - 1 :
-            portion_size * (current_portion + 1);
+        return false;
+    }
+};
 
-        for (size_t i = portion_begin; i < portion_end; ++i)
+template<class T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+
+// lossless mapping of the coordinates to integers for the checks on the grid:
+// (x - origin_x) / step, (y - origin_y) / step, the step is the largest power of 2 all the coordinates are multiples of
+struct GridMapping
+{
+    // no more than this many steps along an axis, so the differences fit into int32 and the projections into int64
+    static constexpr int64_t max_range = (int64_t(1) << 31) - 1;
+
+    // no more than this many steps along an axis for the narrow kernels, the projections fit into int32 then
+    static constexpr int64_t max_narrow_range = (int64_t(1) << 15) - 1;
+
+    int step_exponent = 0;
+    int64_t origin_x = 0; // in steps
+    int64_t origin_y = 0;
+    int64_t range = 0;    // the largest integer coordinate
+
+    // false if the triangles span more than max_range steps along an axis or have coordinates which aren't finite
+    bool build(const std::vector<Triangle>& triangles)
+    {
+        // every nonzero coordinate is mantissa * 2^(exponent - 24) with the mantissa below 2^24,
+        // the coordinates are below 2^max_exponent and multiples of 2^step_exponent
+        int max_exponent = std::numeric_limits<int>::min();
+        step_exponent = std::numeric_limits<int>::max();
+        for (const auto& tri : triangles)
         {
-            for (size_t j = i + 1; j < triangles_count; ++j)
+            for (float value : { tri.a.x, tri.a.y, tri.b.x, tri.b.y, tri.c.x, tri.c.y })
             {
-                const auto& tri1 = in_triangles[i];
-                const auto& tri2 = in_triangles[j];
-
-                if (areIntersected(tri1, tri2))
+                if (!std::isfinite(value))
                 {
-                    markIntersected(i, j);
+                    return false;
                 }
+                if (value == 0)
+                {
+                    continue;
+                }
+                int exponent;
+                auto mantissa = static_cast<int32_t>(std::ldexp(std::frexp(std::fabs(value), &exponent), 24));
+                max_exponent = std::max(max_exponent, exponent);
+                int lowest_exponent = exponent - 24;
+                for (; (mantissa & 1) == 0; mantissa >>= 1)
+                {
+                    ++lowest_exponent;
+                }
+                step_exponent = std::min(step_exponent, lowest_exponent);
+            }
+        }
+        if (step_exponent == std::numeric_limits<int>::max())
+        {
+            // all the coordinates are zero
+            step_exponent = 0;
+            max_exponent = 0;
+        }
+
+        // the coordinates in steps, exact in double and int64 if they are below 2^62
+        if (max_exponent - step_exponent > 62)
+        {
+            return false;
+        }
+        origin_x = std::numeric_limits<int64_t>::max();
+        origin_y = std::numeric_limits<int64_t>::max();
+        int64_t end_x = std::numeric_limits<int64_t>::min();
+        int64_t end_y = std::numeric_limits<int64_t>::min();
+        for (const auto& tri : triangles)
+        {
+            for (const auto& point : { tri.a, tri.b, tri.c })
+            {
+                origin_x = std::min(origin_x, toSteps(point.x));
+                origin_y = std::min(origin_y, toSteps(point.y));
+                end_x = std::max(end_x, toSteps(point.x));
+                end_y = std::max(end_y, toSteps(point.y));
             }
         }
+        range = triangles.empty() ? 0 : std::max(end_x - origin_x, end_y - origin_y);
+        return range <= max_range;
     }
 
-public:
-    IntersectionsChecker(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count) :
-        in_triangles(in_triangles),
-        out_count(out_count),
-        triangles_count(in_triangles.size()),
-        out_count_atomic(triangles_count)
+    bool isNarrow() const
     {
+        return range <= max_narrow_range;
     }
 
-    void fillIntersectionsVector()
+    float getStep() const
     {
-        auto num_of_threads = std::thread::hardware_concurrency();
-        std::vector<std::thread> threads;
+        return std::ldexp(1.0f, step_exponent);
+    }
 
-        threads.reserve(num_of_threads);
-        for (size_t i = 0; i < num_of_threads; ++i)
+    // the smallest coordinates, exactly
+    float getOriginX() const
+    {
+        return std::ldexp(static_cast<float>(origin_x), step_exponent);
+    }
+
+    float getOriginY() const
+    {
+        return std::ldexp(static_cast<float>(origin_y), step_exponent);
+    }
+
+    int32_t getX(float x) const
+    {
+        return static_cast<int32_t>(toSteps(x) - origin_x);
+    }
+
+    int32_t getY(float y) const
+    {
+        return static_cast<int32_t>(toSteps(y) - origin_y);
+    }
+
+private:
+    int64_t toSteps(float value) const
+    {
+        return static_cast<int64_t>(std::ldexp(static_cast<double>(value), -step_exponent));
+    }
+};
+
+
+// triangles with everything that doesn't depend on the second triangle of a pair calculated once
+// for the side k of the triangle i (k = 0, 1, 2 for the sides ab, bc, ca):
+// point_x[k][i], point_y[k][i] - begin of the side (the k-th point of the triangle)
+// normal_x[k][i], normal_y[k][i] - normal of the side
+// shadow_begin[k][i], shadow_end[k][i] - shadow of the triangle itself on the normal
+// min_x[i], min_y[i], max_x[i], max_y[i] - bounding box, used instead of the shadows on the coordinate axes
+// the results are exactly the same as the ones of areIntersected(const Triangle&, const Triangle&)
+struct PreparedTriangles
+{
+    // the widest register used by the vectorized checks, in floats
+    static constexpr size_t max_lanes_count = 16;
+
+    AlignedVector<float> point_x[3];
+    AlignedVector<float> point_y[3];
+    AlignedVector<float> normal_x[3];
+    AlignedVector<float> normal_y[3];
+    AlignedVector<float> shadow_begin[3];
+    AlignedVector<float> shadow_end[3];
+    AlignedVector<float> min_x;
+    AlignedVector<float> min_y;
+    AlignedVector<float> max_x;
+    AlignedVector<float> max_y;
+
+    // the points on the grid (see GridMapping), filled only by prepareOnGrid
+    AlignedVector<int32_t> grid_x[3];
+    AlignedVector<int32_t> grid_y[3];
+
+    // the arrays are padded, so the vectorized checks can read a full register after the last triangle
+    void resize(size_t triangles_count)
+    {
+        const size_t padded_count = triangles_count + max_lanes_count;
+        for (int side = 0; side < 3; ++side)
         {
-            threads.emplace_back(&IntersectionsChecker::checkPortionOfTriangles, this, num_of_threads, i);
+            point_x[side].resize(padded_count);
+            point_y[side].resize(padded_count);
+            normal_x[side].resize(padded_count);
+            normal_y[side].resize(padded_count);
+            shadow_begin[side].resize(padded_count);
+            shadow_end[side].resize(padded_count);
         }
+        min_x.resize(padded_count);
+        min_y.resize(padded_count);
+        max_x.resize(padded_count);
+        max_y.resize(padded_count);
+    }
 
-        // while the checks are running, resize out_count array
-        out_count.resize(triangles_count);
+    // fills the triangles [begin, end), can be called from several threads for different ranges
+    void prepare(const std::vector<Triangle>& triangles, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            prepare(i, triangles[i]);
+        }
+    }
 
-        for (auto& t : threads)
+    // same as prepare, also fills the points on the grid, resizeOnGrid must be called before
+    void prepareOnGrid(const std::vector<Triangle>& triangles, size_t begin, size_t end, const GridMapping& mapping)
+    {
+        for (size_t i = begin; i < end; ++i)
         {
-            t.join();
+            const auto& tri = triangles[i];
+            prepare(i, tri);
+            const Point points[] = { tri.a, tri.b, tri.c };
+            for (int k = 0; k < 3; ++k)
+            {
+                grid_x[k][i] = mapping.getX(points[k].x);
+                grid_y[k][i] = mapping.getY(points[k].y);
+            }
         }
+    }
 
-        for (int i = 0; i < triangles_count; ++i)
+    void resizeOnGrid(size_t triangles_count)
+    {
+        resize(triangles_count);
+        for (int k = 0; k < 3; ++k)
+        {
+            grid_x[k].resize(triangles_count + max_lanes_count);
+            grid_y[k].resize(triangles_count + max_lanes_count);
+        }
+    }
+
+    void prepare(size_t i, const Triangle& tri)
+    {
+        prepareSide(i, 0, tri.a, tri.b, tri.c);
+        prepareSide(i, 1, tri.b, tri.c, tri.a);
+        prepareSide(i, 2, tri.c, tri.a, tri.b);
+
+        auto box = BoundingBox::fromTriangle(tri);
+        min_x[i] = box.min_x;
+        min_y[i] = box.min_y;
+        max_x[i] = box.max_x;
+        max_y[i] = box.max_y;
+    }
+
+    bool areIntersected(size_t i, size_t j) const
+    {
+        return areBoundingBoxesIntersected(i, j) &&
+            areIntersectedRelativelyToFirstTriangle(i, j) &&
+            areIntersectedRelativelyToFirstTriangle(j, i);
+    }
+
+    bool areBoundingBoxesIntersected(size_t i, size_t j) const
+    {
+        return BoundingBox::areIntersected({ min_x[i], min_y[i], max_x[i], max_y[i] },
+            { min_x[j], min_y[j], max_x[j], max_y[j] });
+    }
+
+    bool areIntersectedRelativelyToFirstTriangle(size_t i, size_t j) const
+    {
+        return areIntersectedRelativelyToSide(i, 0, j) &&
+            areIntersectedRelativelyToSide(i, 1, j) &&
+            areIntersectedRelativelyToSide(i, 2, j);
+    }
+
+    // same as areIntersectedRelativelyToFirstTriangle, but exact:
+    // a side is decided by the float projections if they are farther from the borders of the shadows
+    // than the error bound of the float evaluation, otherwise by areIntersectedRelativelyToSideExactly
+    bool areIntersectedRelativelyToFirstTriangleExactly(size_t i, size_t j) const
+    {
+        for (int side = 0; side < 3; ++side)
+        {
+            int is_intersected = getSideIntersectionByFloats(i, side, j);
+            if (is_intersected < 0)
+            {
+                const Point tri2[] = { getPoint(j, 0), getPoint(j, 1), getPoint(j, 2) };
+                is_intersected = areIntersectedRelativelyToSideExactly(getPoint(i, side), getPoint(i, (side + 1) % 3),
+                    getPoint(i, (side + 2) % 3), tri2) ? 1 : 0;
+            }
+            if (is_intersected == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // side k of the triangle i on the grid, with the shadow of the triangle itself
+    // the values fit into int64 for the coordinates up to GridMapping::max_range
+    // and into int32 for the ones up to GridMapping::max_narrow_range
+    struct GridSide
+    {
+        int64_t begin_x;
+        int64_t begin_y;
+        int64_t normal_x;
+        int64_t normal_y;
+        int64_t shadow_begin;
+        int64_t shadow_end;
+
+        int64_t getProjection(int64_t x, int64_t y) const
+        {
+            return normal_x * (x - begin_x) + normal_y * (y - begin_y);
+        }
+    };
+
+    GridSide getGridSide(size_t i, int side) const
+    {
+        const int next = (side + 1) % 3;
+        const int last = (side + 2) % 3;
+        GridSide grid_side = {
+                grid_x[side][i],
+                grid_y[side][i],
+                -(static_cast<int64_t>(grid_y[next][i]) - grid_y[side][i]),
+                static_cast<int64_t>(grid_x[next][i]) - grid_x[side][i],
+                0,
+                0
+        };
+        const int64_t projection_of_third_point = grid_side.getProjection(grid_x[last][i], grid_y[last][i]);
+        grid_side.shadow_begin = std::min<int64_t>(0, projection_of_third_point);
+        grid_side.shadow_end = std::max<int64_t>(0, projection_of_third_point);
+        return grid_side;
+    }
+
+    // same as areIntersectedRelativelyToFirstTriangle, but exact, in integers on the grid
+    bool areIntersectedRelativelyToFirstTriangleOnGrid(size_t i, size_t j) const
+    {
+        for (int side = 0; side < 3; ++side)
+        {
+            const auto grid_side = getGridSide(i, side);
+            int64_t projections_begin = std::numeric_limits<int64_t>::max();
+            int64_t projections_end = std::numeric_limits<int64_t>::min();
+            for (int k = 0; k < 3; ++k)
+            {
+                const int64_t projection = grid_side.getProjection(grid_x[k][j], grid_y[k][j]);
+                projections_begin = std::min(projections_begin, projection);
+                projections_end = std::max(projections_end, projection);
+            }
+            if (projections_begin > grid_side.shadow_end || projections_end < grid_side.shadow_begin)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // side separating the triangles, 0, 1, 2 for the sides of i, 3, 4, 5 for the sides of j, -1 if there is none
+    // the bounding boxes are not checked
+    int findSeparatingSide(size_t i, size_t j) const
+    {
+        for (int side = 0; side < 6; ++side)
+        {
+            if (isSeparatedBySide(i, j, side))
+            {
+                return side;
+            }
+        }
+        return -1;
+    }
+
+    bool isSeparatedBySide(size_t i, size_t j, int side) const
+    {
+        return side < 3 ?
+            !areIntersectedRelativelyToSide(i, side, j) :
+            !areIntersectedRelativelyToSide(j, side - 3, i);
+    }
+
+private:
+    Point getPoint(size_t i, int k) const
+    {
+        return { point_x[k][i], point_y[k][i] };
+    }
+
+    void prepareSide(size_t i, int side, const Point& side_begin, const Point& side_end,
+        const Point& last_point_of_triangle)
+    {
+        Vector2D normal = Vector2D(side_begin, side_end).getNormal();
+        float projection_of_third_point = normal.getPseudoProjection({ side_begin, last_point_of_triangle });
+        auto shadow = Shadow::fromProjectedPoints(0, projection_of_third_point);
+
+        point_x[side][i] = side_begin.x;
+        point_y[side][i] = side_begin.y;
+        normal_x[side][i] = normal.x;
+        normal_y[side][i] = normal.y;
+        shadow_begin[side][i] = shadow.getBegin();
+        shadow_end[side][i] = shadow.getEnd();
+    }
+
+    // 1 if the shadows on the normal of the side are intersected, 0 if they are not,
+    // -1 if the float projections are too close to the borders of the shadows to tell it
+    // every projection (the third point of the triangle i included) is off by no more than
+    // 4 float epsilons times the sum of the absolute values of its products (plus the underflows),
+    // the bound is taken twice as large to cover the roundings of the bound itself and of the comparisons
+    int getSideIntersectionByFloats(size_t i, int side, size_t j) const
+    {
+        const float begin_x = point_x[side][i];
+        const float begin_y = point_y[side][i];
+        const float normal_x_i = normal_x[side][i];
+        const float normal_y_i = normal_y[side][i];
+
+        const int last_point = (side + 2) % 3;
+        const float last_magnitude = std::fabs(normal_x_i * (point_x[last_point][i] - begin_x)) +
+            std::fabs(normal_y_i * (point_y[last_point][i] - begin_y));
+
+        float projections_begin = std::numeric_limits<float>::infinity();
+        float projections_end = -std::numeric_limits<float>::infinity();
+        float magnitude = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            const float product_x = normal_x_i * (point_x[k][j] - begin_x);
+            const float product_y = normal_y_i * (point_y[k][j] - begin_y);
+            const float projection = product_x + product_y;
+            projections_begin = std::min(projections_begin, projection);
+            projections_end = std::max(projections_end, projection);
+            magnitude = std::max(magnitude, std::fabs(product_x) + std::fabs(product_y));
+        }
+
+        const float error_bound = 8 * std::numeric_limits<float>::epsilon() / 2 * (last_magnitude + magnitude) +
+            8 * std::numeric_limits<float>::denorm_min();
+        if (projections_begin <= shadow_end[side][i] - error_bound &&
+            projections_end >= shadow_begin[side][i] + error_bound)
+        {
+            return 1;
+        }
+        if (projections_begin > shadow_end[side][i] + error_bound ||
+            projections_end < shadow_begin[side][i] - error_bound)
         {
-            out_count[i] = out_count_atomic[i];
+            return 0;
         }
+        return -1;
+    }
+
+    // same as areIntersectedRelativelyToSide, only the triangle j is projected
+    bool areIntersectedRelativelyToSide(size_t i, int side, size_t j) const
+    {
+        const float begin_x = point_x[side][i];
+        const float begin_y = point_y[side][i];
+        const Vector2D normal(normal_x[side][i], normal_y[side][i]);
+
+        auto shadow_tri2 = Shadow::fromProjectedPoints(
+            normal.getPseudoProjection({ point_x[0][j] - begin_x, point_y[0][j] - begin_y }),
+            normal.getPseudoProjection({ point_x[1][j] - begin_x, point_y[1][j] - begin_y }),
+            normal.getPseudoProjection({ point_x[2][j] - begin_x, point_y[2][j] - begin_y }));
+
+        return Shadow::areIntersected(Shadow::fromBorders(shadow_begin[side][i], shadow_end[side][i]), shadow_tri2);
     }
 };
 
 
-void Task::checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count)
+// random numbers of the sampling passes, splitmix64
+inline uint64_t getNextRandom(uint64_t& state)
 {
-    IntersectionsChecker checker(in_triangles, out_count);
-    checker.fillIntersectionsVector();
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// random number in [0, count), by a multiplication instead of a division
+inline size_t getRandomIndex(uint64_t& state, size_t count)
+{
+    return static_cast<size_t>(((getNextRandom(state) >> 32) * static_cast<uint64_t>(count)) >> 32);
+}
 
+
+// the kernels below check the triangle i against several triangles at once
+// bit k of the result is set if the triangle i intersects the k-th of them:
+// the triangle first + k, or the triangle candidates[k], k < count <= lanes_count
+// the pairs go through three stages: bounding boxes, sides of the triangle i, sides of the other triangle,
+// the number of pairs rejected by every stage is added to the stats
+// the vectorized kernels do the same float operations in the same order as the scalar check
+// (so they must not be contracted into FMA, see TARGET_AVX512)
+
+// missing candidates are replaced by the last one and masked out
+template<size_t LanesCount>
+void fillLanesIndices(int (&indices)[LanesCount], const int* candidates, size_t count)
+{
+    for (size_t lane = 0; lane < LanesCount; ++lane)
+    {
+        indices[lane] = candidates[std::min(lane, count - 1)];
+    }
+}
+
+inline size_t countBits(int mask)
+{
+    return std::bitset<32>(static_cast<unsigned int>(mask)).count();
+}
+
+inline int getLanesMask(size_t count)
+{
+    return (1 << count) - 1;
+}
+
+// mask - pairs passed to the stage, passed_mask - pairs passed through it
+inline void countRejected(size_t& rejected_count, int mask, int passed_mask)
+{
+    rejected_count += countBits(mask & ~passed_mask);
+}
+
+
+// how the projections of the pair checks are calculated
+enum class PairArithmetic
+{
+    Float,
+    Exact,  // float, with exact signs where the rounding may change the result
+    OnGrid, // integer, on the grid of GridMapping
+};
+
+// checks the pairs one by one, lanes are used only to call it less often
+// the exact ones always intersect the triangles having a single common point (e.g. a shared vertex),
+// the float one may miss them
+template<PairArithmetic Arithmetic>
+class BasicScalarKernel
+{
+public:
+    static constexpr size_t lanes_count = 4;
+
+    static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, size_t first, size_t count,
+        Task::PairCheckStats& stats)
+    {
+        int mask = 0;
+        for (size_t lane = 0; lane < count; ++lane)
+        {
+            mask |= isIntersected(triangles, i, first + lane, stats) << lane;
+        }
+        return mask;
+    }
+
+    static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const int* candidates, size_t count,
+        Task::PairCheckStats& stats)
+    {
+        int mask = 0;
+        for (size_t lane = 0; lane < count; ++lane)
+        {
+            mask |= isIntersected(triangles, i, candidates[lane], stats) << lane;
+        }
+        return mask;
+    }
+
+private:
+    static int isIntersected(const PreparedTriangles& triangles, size_t i, size_t j, Task::PairCheckStats& stats)
+    {
+        ++stats.checked;
+        if (!triangles.areBoundingBoxesIntersected(i, j))
+        {
+            ++stats.rejected_by_bounding_boxes;
+            return 0;
+        }
+        if (!isIntersectedRelativelyToFirstTriangle(triangles, i, j))
+        {
+            ++stats.rejected_by_first_triangle;
+            return 0;
+        }
+        if (!isIntersectedRelativelyToFirstTriangle(triangles, j, i))
+        {
+            ++stats.rejected_by_second_triangle;
+            return 0;
+        }
+        return 1;
+    }
+
+    static bool isIntersectedRelativelyToFirstTriangle(const PreparedTriangles& triangles, size_t i, size_t j)
+    {
+        switch (Arithmetic)
+        {
+        case PairArithmetic::Exact:
+            return triangles.areIntersectedRelativelyToFirstTriangleExactly(i, j);
+        case PairArithmetic::OnGrid:
+            return triangles.areIntersectedRelativelyToFirstTriangleOnGrid(i, j);
+        default:
+            return triangles.areIntersectedRelativelyToFirstTriangle(i, j);
+        }
+    }
+};
+
+using ScalarKernel = BasicScalarKernel<PairArithmetic::Float>;
+using ExactKernel = BasicScalarKernel<PairArithmetic::Exact>;
+using ScalarGridKernel = BasicScalarKernel<PairArithmetic::OnGrid>;
+
+
+// SSE4.1, 4 triangles at once
+class SseKernel
+{
+public:
+    static constexpr size_t lanes_count = 4;
+
+    static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, size_t first, size_t count,
+        Task::PairCheckStats& stats)
+    {
+        return getIntersectionMask(triangles, i, RangeLoader{ first }, getLanesMask(count), stats);
+    }
+
+    static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const int* candidates, size_t count,
+        Task::PairCheckStats& stats)
+    {
+        GatherLoader loader;
+        fillLanesIndices(loader.indices, candidates, count);
+        return getIntersectionMask(triangles, i, loader, getLanesMask(count), stats);
+    }
+
+private:
+    struct RangeLoader
+    {
+        size_t first;
+
+        __m128 load(const AlignedVector<float>& values) const
+        {
+            return _mm_loadu_ps(values.data() + first);
+        }
+    };
+
+    struct GatherLoader
+    {
+        int indices[lanes_count];
+
+        __m128 load(const AlignedVector<float>& values) const
+        {
+            return _mm_setr_ps(values[indices[0]], values[indices[1]], values[indices[2]], values[indices[3]]);
+        }
+    };
+
+    // same as Vector2D::getPseudoProjection for 4 points at once
+    static __m128 getPseudoProjection(__m128 normal_x, __m128 normal_y, __m128 begin_x, __m128 begin_y,
+        __m128 x, __m128 y)
+    {
+        return _mm_add_ps(
+            _mm_mul_ps(normal_x, _mm_sub_ps(x, begin_x)),
+            _mm_mul_ps(normal_y, _mm_sub_ps(y, begin_y)));
+    }
+
+    // same as Shadow::areIntersected for 4 pairs of shadows at once, the second shadows are given by 3 points
+    static __m128 areShadowsIntersected(__m128 begin, __m128 end, __m128 p1, __m128 p2, __m128 p3)
+    {
+        __m128 shadow_begin = _mm_min_ps(_mm_min_ps(p1, p2), p3);
+        __m128 shadow_end = _mm_max_ps(_mm_max_ps(p1, p2), p3);
+        return _mm_and_ps(_mm_cmple_ps(begin, shadow_end), _mm_cmpge_ps(end, shadow_begin));
+    }
+
+    template<class Loader>
+    static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const Loader& loader,
+        int lanes_mask, Task::PairCheckStats& stats)
+    {
+        const auto& t = triangles;
+        stats.checked += countBits(lanes_mask);
+
+        // the bounding boxes
+        __m128 mask = _mm_and_ps(
+            _mm_and_ps(
+                _mm_cmple_ps(_mm_set1_ps(t.min_x[i]), loader.load(t.max_x)),
+                _mm_cmpge_ps(_mm_set1_ps(t.max_x[i]), loader.load(t.min_x))),
+            _mm_and_ps(
+                _mm_cmple_ps(_mm_set1_ps(t.min_y[i]), loader.load(t.max_y)),
+                _mm_cmpge_ps(_mm_set1_ps(t.max_y[i]), loader.load(t.min_y))));
+        const int boxes_mask = _mm_movemask_ps(mask) & lanes_mask;
+        countRejected(stats.rejected_by_bounding_boxes, lanes_mask, boxes_mask);
+        if (boxes_mask == 0)
+        {
+            return 0;
+        }
+
+        const __m128 x[3] = { loader.load(t.point_x[0]), loader.load(t.point_x[1]), loader.load(t.point_x[2]) };
+        const __m128 y[3] = { loader.load(t.point_y[0]), loader.load(t.point_y[1]), loader.load(t.point_y[2]) };
+
+        // the sides of the triangle i
+        for (int side = 0; side < 3; ++side)
+        {
+            const __m128 normal_x_i = _mm_set1_ps(t.normal_x[side][i]);
+            const __m128 normal_y_i = _mm_set1_ps(t.normal_y[side][i]);
+            const __m128 begin_x_i = _mm_set1_ps(t.point_x[side][i]);
+            const __m128 begin_y_i = _mm_set1_ps(t.point_y[side][i]);
+            mask = _mm_and_ps(mask, areShadowsIntersected(
+                _mm_set1_ps(t.shadow_begin[side][i]), _mm_set1_ps(t.shadow_end[side][i]),
+                getPseudoProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[0], y[0]),
+                getPseudoProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[1], y[1]),
+                getPseudoProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[2], y[2])));
+        }
+        const int first_mask = _mm_movemask_ps(mask) & boxes_mask;
+        countRejected(stats.rejected_by_first_triangle, boxes_mask, first_mask);
+        if (first_mask == 0)
+        {
+            return 0;
+        }
+
+        // the sides of the other triangles
+        for (int side = 0; side < 3; ++side)
+        {
+            const __m128 normal_x_j = loader.load(t.normal_x[side]);
+            const __m128 normal_y_j = loader.load(t.normal_y[side]);
+            mask = _mm_and_ps(mask, areShadowsIntersected(
+                loader.load(t.shadow_begin[side]), loader.load(t.shadow_end[side]),
+                getPseudoProjection(normal_x_j, normal_y_j, x[side], y[side],
+                    _mm_set1_ps(t.point_x[0][i]), _mm_set1_ps(t.point_y[0][i])),
+                getPseudoProjection(normal_x_j, normal_y_j, x[side], y[side],
+                    _mm_set1_ps(t.point_x[1][i]), _mm_set1_ps(t.point_y[1][i])),
+                getPseudoProjection(normal_x_j, normal_y_j, x[side], y[side],
+                    _mm_set1_ps(t.point_x[2][i]), _mm_set1_ps(t.point_y[2][i]))));
+        }
+        const int second_mask = _mm_movemask_ps(mask) & first_mask;
+        countRejected(stats.rejected_by_second_triangle, first_mask, second_mask);
+
+        return second_mask;
+    }
+};
+
+
+// AVX2, 8 triangles at once
+// compiled for AVX2 regardless of the build flags, called only if the processor supports it
+class Avx2Kernel
+{
+public:
+    static constexpr size_t lanes_count = 8;
+
+    TARGET_AVX2 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        size_t first, size_t count, Task::PairCheckStats& stats)
+    {
+        return getIntersectionMask(triangles, i, RangeLoader{ first }, getLanesMask(count), stats);
+    }
+
+    TARGET_AVX2 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        const int* candidates, size_t count, Task::PairCheckStats& stats)
+    {
+        int indices[lanes_count];
+        fillLanesIndices(indices, candidates, count);
+        return getIntersectionMask(triangles, i,
+            GatherLoader{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)) },
+            getLanesMask(count), stats);
+    }
+
+private:
+    struct RangeLoader
+    {
+        size_t first;
+
+        TARGET_AVX2 __m256 load(const AlignedVector<float>& values) const
+        {
+            return _mm256_loadu_ps(values.data() + first);
+        }
+    };
+
+    struct GatherLoader
+    {
+        __m256i indices;
+
+        TARGET_AVX2 __m256 load(const AlignedVector<float>& values) const
+        {
+            return _mm256_i32gather_ps(values.data(), indices, sizeof(float));
+        }
+    };
+
+    TARGET_AVX2 static __m256 getPseudoProjection(__m256 normal_x, __m256 normal_y, __m256 begin_x, __m256 begin_y,
+        __m256 x, __m256 y)
+    {
+        return _mm256_add_ps(
+            _mm256_mul_ps(normal_x, _mm256_sub_ps(x, begin_x)),
+            _mm256_mul_ps(normal_y, _mm256_sub_ps(y, begin_y)));
+    }
+
+    TARGET_AVX2 static __m256 areShadowsIntersected(__m256 begin, __m256 end, __m256 p1, __m256 p2, __m256 p3)
+    {
+        __m256 shadow_begin = _mm256_min_ps(_mm256_min_ps(p1, p2), p3);
+        __m256 shadow_end = _mm256_max_ps(_mm256_max_ps(p1, p2), p3);
+        return _mm256_and_ps(
+            _mm256_cmp_ps(begin, shadow_end, _CMP_LE_OQ),
+            _mm256_cmp_ps(end, shadow_begin, _CMP_GE_OQ));
+    }
+
+    template<class Loader>
+    TARGET_AVX2 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const Loader& loader,
+        int lanes_mask, Task::PairCheckStats& stats)
+    {
+        const auto& t = triangles;
+        stats.checked += countBits(lanes_mask);
+
+        // the bounding boxes
+        __m256 mask = _mm256_and_ps(
+            _mm256_and_ps(
+                _mm256_cmp_ps(_mm256_set1_ps(t.min_x[i]), loader.load(t.max_x), _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_set1_ps(t.max_x[i]), loader.load(t.min_x), _CMP_GE_OQ)),
+            _mm256_and_ps(
+                _mm256_cmp_ps(_mm256_set1_ps(t.min_y[i]), loader.load(t.max_y), _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_set1_ps(t.max_y[i]), loader.load(t.min_y), _CMP_GE_OQ)));
+        const int boxes_mask = _mm256_movemask_ps(mask) & lanes_mask;
+        countRejected(stats.rejected_by_bounding_boxes, lanes_mask, boxes_mask);
+        if (boxes_mask == 0)
+        {
+            return 0;
+        }
+
+        const __m256 x[3] = { loader.load(t.point_x[0]), loader.load(t.point_x[1]), loader.load(t.point_x[2]) };
+        const __m256 y[3] = { loader.load(t.point_y[0]), loader.load(t.point_y[1]), loader.load(t.point_y[2]) };
+
+        // the sides of the triangle i
+        for (int side = 0; side < 3; ++side)
+        {
+            const __m256 normal_x_i = _mm256_set1_ps(t.normal_x[side][i]);
+            const __m256 normal_y_i = _mm256_set1_ps(t.normal_y[side][i]);
+            const __m256 begin_x_i = _mm256_set1_ps(t.point_x[side][i]);
+            const __m256 begin_y_i = _mm256_set1_ps(t.point_y[side][i]);
+            mask = _mm256_and_ps(mask, areShadowsIntersected(
+                _mm256_set1_ps(t.shadow_begin[side][i]), _mm256_set1_ps(t.shadow_end[side][i]),
+                getPseudoProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[0], y[0]),
+                getPseudoProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[1], y[1]),
+                getPseudoProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[2], y[2])));
+        }
+        const int first_mask = _mm256_movemask_ps(mask) & boxes_mask;
+        countRejected(stats.rejected_by_first_triangle, boxes_mask, first_mask);
+        if (first_mask == 0)
+        {
+            return 0;
+        }
+
+        // the sides of the other triangles
+        for (int side = 0; side < 3; ++side)
+        {
+            const __m256 normal_x_j = loader.load(t.normal_x[side]);
+            const __m256 normal_y_j = loader.load(t.normal_y[side]);
+            mask = _mm256_and_ps(mask, areShadowsIntersected(
+                loader.load(t.shadow_begin[side]), loader.load(t.shadow_end[side]),
+                getPseudoProjection(normal_x_j, normal_y_j, x[side], y[side],
+                    _mm256_set1_ps(t.point_x[0][i]), _mm256_set1_ps(t.point_y[0][i])),
+                getPseudoProjection(normal_x_j, normal_y_j, x[side], y[side],
+                    _mm256_set1_ps(t.point_x[1][i]), _mm256_set1_ps(t.point_y[1][i])),
+                getPseudoProjection(normal_x_j, normal_y_j, x[side], y[side],
+                    _mm256_set1_ps(t.point_x[2][i]), _mm256_set1_ps(t.point_y[2][i]))));
+        }
+        const int second_mask = _mm256_movemask_ps(mask) & first_mask;
+        countRejected(stats.rejected_by_second_triangle, first_mask, second_mask);
+
+        return second_mask;
+    }
+};
+
+
+// AVX-512, 16 triangles at once
+// the comparisons of the next axis are done only for the lanes not separated yet
+class Avx512Kernel
+{
+public:
+    static constexpr size_t lanes_count = 16;
+
+    TARGET_AVX512 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        size_t first, size_t count, Task::PairCheckStats& stats)
+    {
+        return getIntersectionMask(triangles, i, RangeLoader{ first },
+            static_cast<__mmask16>(getLanesMask(count)), stats);
+    }
+
+    TARGET_AVX512 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        const int* candidates, size_t count, Task::PairCheckStats& stats)
+    {
+        int indices[lanes_count];
+        fillLanesIndices(indices, candidates, count);
+        return getIntersectionMask(triangles, i, GatherLoader{ _mm512_loadu_si512(indices) },
+            static_cast<__mmask16>(getLanesMask(count)), stats);
+    }
+
+private:
+    struct RangeLoader
+    {
+        size_t first;
+
+        TARGET_AVX512 __m512 load(const AlignedVector<float>& values) const
+        {
+            return _mm512_loadu_ps(values.data() + first);
+        }
+    };
+
+    struct GatherLoader
+    {
+        __m512i indices;
+
+        TARGET_AVX512 __m512 load(const AlignedVector<float>& values) const
+        {
+            return _mm512_i32gather_ps(indices, values.data(), sizeof(float));
+        }
+    };
+
+    TARGET_AVX512 static __m512 getPseudoProjection(__m512 normal_x, __m512 normal_y, __m512 begin_x, __m512 begin_y,
+        __m512 x, __m512 y)
+    {
+        return _mm512_add_ps(
+            _mm512_mul_ps(normal_x, _mm512_sub_ps(x, begin_x)),
+            _mm512_mul_ps(normal_y, _mm512_sub_ps(y, begin_y)));
+    }
+
+    TARGET_AVX512 static __mmask16 areShadowsIntersected(__mmask16 mask, __m512 begin, __m512 end,
+        __m512 p1, __m512 p2, __m512 p3)
+    {
+        __m512 shadow_begin = _mm512_min_ps(_mm512_min_ps(p1, p2), p3);
+        __m512 shadow_end = _mm512_max_ps(_mm512_max_ps(p1, p2), p3);
+        mask = _mm512_mask_cmp_ps_mask(mask, begin, shadow_end, _CMP_LE_OQ);
+        return _mm512_mask_cmp_ps_mask(mask, end, shadow_begin, _CMP_GE_OQ);
+    }
+
+    template<class Loader>
+    TARGET_AVX512 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const Loader& loader,
+        __mmask16 lanes_mask, Task::PairCheckStats& stats)
+    {
+        const auto& t = triangles;
+        stats.checked += countBits(lanes_mask);
+
+        // the bounding boxes
+        __mmask16 mask = _mm512_mask_cmp_ps_mask(lanes_mask,
+            _mm512_set1_ps(t.min_x[i]), loader.load(t.max_x), _CMP_LE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_set1_ps(t.max_x[i]), loader.load(t.min_x), _CMP_GE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_set1_ps(t.min_y[i]), loader.load(t.max_y), _CMP_LE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_set1_ps(t.max_y[i]), loader.load(t.min_y), _CMP_GE_OQ);
+        const __mmask16 boxes_mask = mask;
+        countRejected(stats.rejected_by_bounding_boxes, lanes_mask, boxes_mask);
+        if (boxes_mask == 0)
+        {
+            return 0;
+        }
+
+        const __m512 x[3] = { loader.load(t.point_x[0]), loader.load(t.point_x[1]), loader.load(t.point_x[2]) };
+        const __m512 y[3] = { loader.load(t.point_y[0]), loader.load(t.point_y[1]), loader.load(t.point_y[2]) };
+
+        // the sides of the triangle i
+        for (int side = 0; side < 3; ++side)
+        {
+            const __m512 normal_x_i = _mm512_set1_ps(t.normal_x[side][i]);
+            const __m512 normal_y_i = _mm512_set1_ps(t.normal_y[side][i]);
+            const __m512 begin_x_i = _mm512_set1_ps(t.point_x[side][i]);
+            const __m512 begin_y_i = _mm512_set1_ps(t.point_y[side][i]);
+            mask = areShadowsIntersected(mask,
+                _mm512_set1_ps(t.shadow_begin[side][i]), _mm512_set1_ps(t.shadow_end[side][i]),
+                getPseudoProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[0], y[0]),
+                getPseudoProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[1], y[1]),
+                getPseudoProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[2], y[2]));
+        }
+        const __mmask16 first_mask = mask;
+        countRejected(stats.rejected_by_first_triangle, boxes_mask, first_mask);
+        if (first_mask == 0)
+        {
+            return 0;
+        }
+
+        // the sides of the other triangles
+        for (int side = 0; side < 3; ++side)
+        {
+            const __m512 normal_x_j = loader.load(t.normal_x[side]);
+            const __m512 normal_y_j = loader.load(t.normal_y[side]);
+            mask = areShadowsIntersected(mask,
+                loader.load(t.shadow_begin[side]), loader.load(t.shadow_end[side]),
+                getPseudoProjection(normal_x_j, normal_y_j, x[side], y[side],
+                    _mm512_set1_ps(t.point_x[0][i]), _mm512_set1_ps(t.point_y[0][i])),
+                getPseudoProjection(normal_x_j, normal_y_j, x[side], y[side],
+                    _mm512_set1_ps(t.point_x[1][i]), _mm512_set1_ps(t.point_y[1][i])),
+                getPseudoProjection(normal_x_j, normal_y_j, x[side], y[side],
+                    _mm512_set1_ps(t.point_x[2][i]), _mm512_set1_ps(t.point_y[2][i])));
+        }
+        countRejected(stats.rejected_by_second_triangle, first_mask, mask);
+
+        return mask;
+    }
+};
+
+
+// the kernels below check the pairs on the grid (see GridMapping), exactly, in integers
+// the bounding boxes are checked in floats as above, the comparisons of floats are exact
+// the projections of the narrow kernels fit into int32 lanes (as many of them as floats in a register),
+// the wide ones use int64 lanes for the products of int32 differences (half as many)
+
+// SSE4.1, 4 triangles at once, narrow
+class SseGridKernel
+{
+public:
+    static constexpr size_t lanes_count = 4;
+
+    static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, size_t first, size_t count,
+        Task::PairCheckStats& stats)
+    {
+        return getIntersectionMask(triangles, i, RangeLoader{ first }, getLanesMask(count), stats);
+    }
+
+    static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const int* candidates, size_t count,
+        Task::PairCheckStats& stats)
+    {
+        GatherLoader loader;
+        fillLanesIndices(loader.indices, candidates, count);
+        return getIntersectionMask(triangles, i, loader, getLanesMask(count), stats);
+    }
+
+private:
+    struct RangeLoader
+    {
+        size_t first;
+
+        __m128 load(const AlignedVector<float>& values) const
+        {
+            return _mm_loadu_ps(values.data() + first);
+        }
+
+        __m128i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm_loadu_si128(reinterpret_cast<const __m128i*>(values.data() + first));
+        }
+    };
+
+    struct GatherLoader
+    {
+        int indices[lanes_count];
+
+        __m128 load(const AlignedVector<float>& values) const
+        {
+            return _mm_setr_ps(values[indices[0]], values[indices[1]], values[indices[2]], values[indices[3]]);
+        }
+
+        __m128i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm_setr_epi32(values[indices[0]], values[indices[1]], values[indices[2]], values[indices[3]]);
+        }
+    };
+
+    static __m128i getProjection(__m128i normal_x, __m128i normal_y, __m128i begin_x, __m128i begin_y,
+        __m128i x, __m128i y)
+    {
+        return _mm_add_epi32(
+            _mm_mullo_epi32(normal_x, _mm_sub_epi32(x, begin_x)),
+            _mm_mullo_epi32(normal_y, _mm_sub_epi32(y, begin_y)));
+    }
+
+    // the lanes where the shadows are not intersected, the second shadows are given by 3 points
+    static __m128i areShadowsSeparated(__m128i begin, __m128i end, __m128i p1, __m128i p2, __m128i p3)
+    {
+        __m128i shadow_begin = _mm_min_epi32(_mm_min_epi32(p1, p2), p3);
+        __m128i shadow_end = _mm_max_epi32(_mm_max_epi32(p1, p2), p3);
+        return _mm_or_si128(_mm_cmpgt_epi32(begin, shadow_end), _mm_cmpgt_epi32(shadow_begin, end));
+    }
+
+    template<class Loader>
+    static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const Loader& loader,
+        int lanes_mask, Task::PairCheckStats& stats)
+    {
+        const auto& t = triangles;
+        stats.checked += countBits(lanes_mask);
+
+        // the bounding boxes
+        __m128 mask = _mm_and_ps(
+            _mm_and_ps(
+                _mm_cmple_ps(_mm_set1_ps(t.min_x[i]), loader.load(t.max_x)),
+                _mm_cmpge_ps(_mm_set1_ps(t.max_x[i]), loader.load(t.min_x))),
+            _mm_and_ps(
+                _mm_cmple_ps(_mm_set1_ps(t.min_y[i]), loader.load(t.max_y)),
+                _mm_cmpge_ps(_mm_set1_ps(t.max_y[i]), loader.load(t.min_y))));
+        const int boxes_mask = _mm_movemask_ps(mask) & lanes_mask;
+        countRejected(stats.rejected_by_bounding_boxes, lanes_mask, boxes_mask);
+        if (boxes_mask == 0)
+        {
+            return 0;
+        }
+
+        const __m128i x[3] = { loader.load(t.grid_x[0]), loader.load(t.grid_x[1]), loader.load(t.grid_x[2]) };
+        const __m128i y[3] = { loader.load(t.grid_y[0]), loader.load(t.grid_y[1]), loader.load(t.grid_y[2]) };
+
+        // the sides of the triangle i
+        __m128i separated = _mm_setzero_si128();
+        for (int side = 0; side < 3; ++side)
+        {
+            const auto grid_side = t.getGridSide(i, side);
+            const __m128i normal_x_i = _mm_set1_epi32(static_cast<int32_t>(grid_side.normal_x));
+            const __m128i normal_y_i = _mm_set1_epi32(static_cast<int32_t>(grid_side.normal_y));
+            const __m128i begin_x_i = _mm_set1_epi32(static_cast<int32_t>(grid_side.begin_x));
+            const __m128i begin_y_i = _mm_set1_epi32(static_cast<int32_t>(grid_side.begin_y));
+            separated = _mm_or_si128(separated, areShadowsSeparated(
+                _mm_set1_epi32(static_cast<int32_t>(grid_side.shadow_begin)),
+                _mm_set1_epi32(static_cast<int32_t>(grid_side.shadow_end)),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[0], y[0]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[1], y[1]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[2], y[2])));
+        }
+        const int first_mask = boxes_mask & ~_mm_movemask_ps(_mm_castsi128_ps(separated));
+        countRejected(stats.rejected_by_first_triangle, boxes_mask, first_mask);
+        if (first_mask == 0)
+        {
+            return 0;
+        }
+
+        // the sides of the other triangles, their shadows are calculated here
+        const __m128i x_i[3] = { _mm_set1_epi32(t.grid_x[0][i]), _mm_set1_epi32(t.grid_x[1][i]),
+            _mm_set1_epi32(t.grid_x[2][i]) };
+        const __m128i y_i[3] = { _mm_set1_epi32(t.grid_y[0][i]), _mm_set1_epi32(t.grid_y[1][i]),
+            _mm_set1_epi32(t.grid_y[2][i]) };
+        for (int side = 0; side < 3; ++side)
+        {
+            const int next = (side + 1) % 3;
+            const int last = (side + 2) % 3;
+            const __m128i normal_x_j = _mm_sub_epi32(y[side], y[next]);
+            const __m128i normal_y_j = _mm_sub_epi32(x[next], x[side]);
+            const __m128i projection_of_third_point =
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x[last], y[last]);
+            separated = _mm_or_si128(separated, areShadowsSeparated(
+                _mm_min_epi32(projection_of_third_point, _mm_setzero_si128()),
+                _mm_max_epi32(projection_of_third_point, _mm_setzero_si128()),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[0], y_i[0]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[1], y_i[1]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[2], y_i[2])));
+        }
+        const int second_mask = first_mask & ~_mm_movemask_ps(_mm_castsi128_ps(separated));
+        countRejected(stats.rejected_by_second_triangle, first_mask, second_mask);
+
+        return second_mask;
+    }
+};
+
+
+// AVX2, 8 triangles at once, narrow
+class Avx2GridKernel
+{
+public:
+    static constexpr size_t lanes_count = 8;
+
+    TARGET_AVX2 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        size_t first, size_t count, Task::PairCheckStats& stats)
+    {
+        return getIntersectionMask(triangles, i, RangeLoader{ first }, getLanesMask(count), stats);
+    }
+
+    TARGET_AVX2 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        const int* candidates, size_t count, Task::PairCheckStats& stats)
+    {
+        int indices[lanes_count];
+        fillLanesIndices(indices, candidates, count);
+        return getIntersectionMask(triangles, i,
+            GatherLoader{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)) },
+            getLanesMask(count), stats);
+    }
+
+private:
+    struct RangeLoader
+    {
+        size_t first;
+
+        TARGET_AVX2 __m256 load(const AlignedVector<float>& values) const
+        {
+            return _mm256_loadu_ps(values.data() + first);
+        }
+
+        TARGET_AVX2 __m256i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values.data() + first));
+        }
+    };
+
+    struct GatherLoader
+    {
+        __m256i indices;
+
+        TARGET_AVX2 __m256 load(const AlignedVector<float>& values) const
+        {
+            return _mm256_i32gather_ps(values.data(), indices, sizeof(float));
+        }
+
+        TARGET_AVX2 __m256i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm256_i32gather_epi32(values.data(), indices, sizeof(int32_t));
+        }
+    };
+
+    TARGET_AVX2 static __m256i getProjection(__m256i normal_x, __m256i normal_y, __m256i begin_x, __m256i begin_y,
+        __m256i x, __m256i y)
+    {
+        return _mm256_add_epi32(
+            _mm256_mullo_epi32(normal_x, _mm256_sub_epi32(x, begin_x)),
+            _mm256_mullo_epi32(normal_y, _mm256_sub_epi32(y, begin_y)));
+    }
+
+    TARGET_AVX2 static __m256i areShadowsSeparated(__m256i begin, __m256i end, __m256i p1, __m256i p2, __m256i p3)
+    {
+        __m256i shadow_begin = _mm256_min_epi32(_mm256_min_epi32(p1, p2), p3);
+        __m256i shadow_end = _mm256_max_epi32(_mm256_max_epi32(p1, p2), p3);
+        return _mm256_or_si256(_mm256_cmpgt_epi32(begin, shadow_end), _mm256_cmpgt_epi32(shadow_begin, end));
+    }
+
+    template<class Loader>
+    TARGET_AVX2 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const Loader& loader,
+        int lanes_mask, Task::PairCheckStats& stats)
+    {
+        const auto& t = triangles;
+        stats.checked += countBits(lanes_mask);
+
+        // the bounding boxes
+        __m256 mask = _mm256_and_ps(
+            _mm256_and_ps(
+                _mm256_cmp_ps(_mm256_set1_ps(t.min_x[i]), loader.load(t.max_x), _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_set1_ps(t.max_x[i]), loader.load(t.min_x), _CMP_GE_OQ)),
+            _mm256_and_ps(
+                _mm256_cmp_ps(_mm256_set1_ps(t.min_y[i]), loader.load(t.max_y), _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_set1_ps(t.max_y[i]), loader.load(t.min_y), _CMP_GE_OQ)));
+        const int boxes_mask = _mm256_movemask_ps(mask) & lanes_mask;
+        countRejected(stats.rejected_by_bounding_boxes, lanes_mask, boxes_mask);
+        if (boxes_mask == 0)
+        {
+            return 0;
+        }
+
+        const __m256i x[3] = { loader.load(t.grid_x[0]), loader.load(t.grid_x[1]), loader.load(t.grid_x[2]) };
+        const __m256i y[3] = { loader.load(t.grid_y[0]), loader.load(t.grid_y[1]), loader.load(t.grid_y[2]) };
+
+        // the sides of the triangle i
+        __m256i separated = _mm256_setzero_si256();
+        for (int side = 0; side < 3; ++side)
+        {
+            const auto grid_side = t.getGridSide(i, side);
+            const __m256i normal_x_i = _mm256_set1_epi32(static_cast<int32_t>(grid_side.normal_x));
+            const __m256i normal_y_i = _mm256_set1_epi32(static_cast<int32_t>(grid_side.normal_y));
+            const __m256i begin_x_i = _mm256_set1_epi32(static_cast<int32_t>(grid_side.begin_x));
+            const __m256i begin_y_i = _mm256_set1_epi32(static_cast<int32_t>(grid_side.begin_y));
+            separated = _mm256_or_si256(separated, areShadowsSeparated(
+                _mm256_set1_epi32(static_cast<int32_t>(grid_side.shadow_begin)),
+                _mm256_set1_epi32(static_cast<int32_t>(grid_side.shadow_end)),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[0], y[0]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[1], y[1]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[2], y[2])));
+        }
+        const int first_mask = boxes_mask & ~_mm256_movemask_ps(_mm256_castsi256_ps(separated));
+        countRejected(stats.rejected_by_first_triangle, boxes_mask, first_mask);
+        if (first_mask == 0)
+        {
+            return 0;
+        }
+
+        // the sides of the other triangles, their shadows are calculated here
+        const __m256i x_i[3] = { _mm256_set1_epi32(t.grid_x[0][i]), _mm256_set1_epi32(t.grid_x[1][i]),
+            _mm256_set1_epi32(t.grid_x[2][i]) };
+        const __m256i y_i[3] = { _mm256_set1_epi32(t.grid_y[0][i]), _mm256_set1_epi32(t.grid_y[1][i]),
+            _mm256_set1_epi32(t.grid_y[2][i]) };
+        for (int side = 0; side < 3; ++side)
+        {
+            const int next = (side + 1) % 3;
+            const int last = (side + 2) % 3;
+            const __m256i normal_x_j = _mm256_sub_epi32(y[side], y[next]);
+            const __m256i normal_y_j = _mm256_sub_epi32(x[next], x[side]);
+            const __m256i projection_of_third_point =
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x[last], y[last]);
+            separated = _mm256_or_si256(separated, areShadowsSeparated(
+                _mm256_min_epi32(projection_of_third_point, _mm256_setzero_si256()),
+                _mm256_max_epi32(projection_of_third_point, _mm256_setzero_si256()),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[0], y_i[0]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[1], y_i[1]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[2], y_i[2])));
+        }
+        const int second_mask = first_mask & ~_mm256_movemask_ps(_mm256_castsi256_ps(separated));
+        countRejected(stats.rejected_by_second_triangle, first_mask, second_mask);
+
+        return second_mask;
+    }
+};
+
+
+// AVX2, 4 triangles at once, wide
+class Avx2WideGridKernel
+{
+public:
+    static constexpr size_t lanes_count = 4;
+
+    TARGET_AVX2 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        size_t first, size_t count, Task::PairCheckStats& stats)
+    {
+        return getIntersectionMask(triangles, i, RangeLoader{ first }, getLanesMask(count), stats);
+    }
+
+    TARGET_AVX2 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        const int* candidates, size_t count, Task::PairCheckStats& stats)
+    {
+        int indices[lanes_count];
+        fillLanesIndices(indices, candidates, count);
+        return getIntersectionMask(triangles, i,
+            GatherLoader{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices)) },
+            getLanesMask(count), stats);
+    }
+
+private:
+    struct RangeLoader
+    {
+        size_t first;
+
+        TARGET_AVX2 __m128 load(const AlignedVector<float>& values) const
+        {
+            return _mm_loadu_ps(values.data() + first);
+        }
+
+        TARGET_AVX2 __m256i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values.data() + first)));
+        }
+    };
+
+    struct GatherLoader
+    {
+        __m128i indices;
+
+        TARGET_AVX2 __m128 load(const AlignedVector<float>& values) const
+        {
+            return _mm_i32gather_ps(values.data(), indices, sizeof(float));
+        }
+
+        TARGET_AVX2 __m256i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm256_cvtepi32_epi64(_mm_i32gather_epi32(values.data(), indices, sizeof(int32_t)));
+        }
+    };
+
+    // the differences fit into int32, so they are multiplied by the low halves of the lanes
+    TARGET_AVX2 static __m256i getProjection(__m256i normal_x, __m256i normal_y, __m256i begin_x, __m256i begin_y,
+        __m256i x, __m256i y)
+    {
+        return _mm256_add_epi64(
+            _mm256_mul_epi32(normal_x, _mm256_sub_epi64(x, begin_x)),
+            _mm256_mul_epi32(normal_y, _mm256_sub_epi64(y, begin_y)));
+    }
+
+    // AVX2 has no min and max of int64
+    TARGET_AVX2 static __m256i getMin(__m256i a, __m256i b)
+    {
+        return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+    }
+
+    TARGET_AVX2 static __m256i getMax(__m256i a, __m256i b)
+    {
+        return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b));
+    }
+
+    TARGET_AVX2 static __m256i areShadowsSeparated(__m256i begin, __m256i end, __m256i p1, __m256i p2, __m256i p3)
+    {
+        __m256i shadow_begin = getMin(getMin(p1, p2), p3);
+        __m256i shadow_end = getMax(getMax(p1, p2), p3);
+        return _mm256_or_si256(_mm256_cmpgt_epi64(begin, shadow_end), _mm256_cmpgt_epi64(shadow_begin, end));
+    }
+
+    template<class Loader>
+    TARGET_AVX2 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const Loader& loader,
+        int lanes_mask, Task::PairCheckStats& stats)
+    {
+        const auto& t = triangles;
+        stats.checked += countBits(lanes_mask);
+
+        // the bounding boxes
+        __m128 mask = _mm_and_ps(
+            _mm_and_ps(
+                _mm_cmple_ps(_mm_set1_ps(t.min_x[i]), loader.load(t.max_x)),
+                _mm_cmpge_ps(_mm_set1_ps(t.max_x[i]), loader.load(t.min_x))),
+            _mm_and_ps(
+                _mm_cmple_ps(_mm_set1_ps(t.min_y[i]), loader.load(t.max_y)),
+                _mm_cmpge_ps(_mm_set1_ps(t.max_y[i]), loader.load(t.min_y))));
+        const int boxes_mask = _mm_movemask_ps(mask) & lanes_mask;
+        countRejected(stats.rejected_by_bounding_boxes, lanes_mask, boxes_mask);
+        if (boxes_mask == 0)
+        {
+            return 0;
+        }
+
+        const __m256i x[3] = { loader.load(t.grid_x[0]), loader.load(t.grid_x[1]), loader.load(t.grid_x[2]) };
+        const __m256i y[3] = { loader.load(t.grid_y[0]), loader.load(t.grid_y[1]), loader.load(t.grid_y[2]) };
+
+        // the sides of the triangle i
+        __m256i separated = _mm256_setzero_si256();
+        for (int side = 0; side < 3; ++side)
+        {
+            const auto grid_side = t.getGridSide(i, side);
+            const __m256i normal_x_i = _mm256_set1_epi64x(grid_side.normal_x);
+            const __m256i normal_y_i = _mm256_set1_epi64x(grid_side.normal_y);
+            const __m256i begin_x_i = _mm256_set1_epi64x(grid_side.begin_x);
+            const __m256i begin_y_i = _mm256_set1_epi64x(grid_side.begin_y);
+            separated = _mm256_or_si256(separated, areShadowsSeparated(
+                _mm256_set1_epi64x(grid_side.shadow_begin), _mm256_set1_epi64x(grid_side.shadow_end),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[0], y[0]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[1], y[1]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[2], y[2])));
+        }
+        const int first_mask = boxes_mask & ~_mm256_movemask_pd(_mm256_castsi256_pd(separated));
+        countRejected(stats.rejected_by_first_triangle, boxes_mask, first_mask);
+        if (first_mask == 0)
+        {
+            return 0;
+        }
+
+        // the sides of the other triangles, their shadows are calculated here
+        const __m256i x_i[3] = { _mm256_set1_epi64x(t.grid_x[0][i]), _mm256_set1_epi64x(t.grid_x[1][i]),
+            _mm256_set1_epi64x(t.grid_x[2][i]) };
+        const __m256i y_i[3] = { _mm256_set1_epi64x(t.grid_y[0][i]), _mm256_set1_epi64x(t.grid_y[1][i]),
+            _mm256_set1_epi64x(t.grid_y[2][i]) };
+        for (int side = 0; side < 3; ++side)
+        {
+            const int next = (side + 1) % 3;
+            const int last = (side + 2) % 3;
+            const __m256i normal_x_j = _mm256_sub_epi64(y[side], y[next]);
+            const __m256i normal_y_j = _mm256_sub_epi64(x[next], x[side]);
+            const __m256i projection_of_third_point =
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x[last], y[last]);
+            separated = _mm256_or_si256(separated, areShadowsSeparated(
+                getMin(projection_of_third_point, _mm256_setzero_si256()),
+                getMax(projection_of_third_point, _mm256_setzero_si256()),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[0], y_i[0]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[1], y_i[1]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[2], y_i[2])));
+        }
+        const int second_mask = first_mask & ~_mm256_movemask_pd(_mm256_castsi256_pd(separated));
+        countRejected(stats.rejected_by_second_triangle, first_mask, second_mask);
+
+        return second_mask;
+    }
+};
+
+
+// AVX-512, 16 triangles at once, narrow
+// the comparisons of the next axis are done only for the lanes not separated yet
+class Avx512GridKernel
+{
+public:
+    static constexpr size_t lanes_count = 16;
+
+    TARGET_AVX512 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        size_t first, size_t count, Task::PairCheckStats& stats)
+    {
+        return getIntersectionMask(triangles, i, RangeLoader{ first },
+            static_cast<__mmask16>(getLanesMask(count)), stats);
+    }
+
+    TARGET_AVX512 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        const int* candidates, size_t count, Task::PairCheckStats& stats)
+    {
+        int indices[lanes_count];
+        fillLanesIndices(indices, candidates, count);
+        return getIntersectionMask(triangles, i, GatherLoader{ _mm512_loadu_si512(indices) },
+            static_cast<__mmask16>(getLanesMask(count)), stats);
+    }
+
+private:
+    struct RangeLoader
+    {
+        size_t first;
+
+        TARGET_AVX512 __m512 load(const AlignedVector<float>& values) const
+        {
+            return _mm512_loadu_ps(values.data() + first);
+        }
+
+        TARGET_AVX512 __m512i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm512_loadu_si512(values.data() + first);
+        }
+    };
+
+    struct GatherLoader
+    {
+        __m512i indices;
+
+        TARGET_AVX512 __m512 load(const AlignedVector<float>& values) const
+        {
+            return _mm512_i32gather_ps(indices, values.data(), sizeof(float));
+        }
+
+        TARGET_AVX512 __m512i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm512_i32gather_epi32(indices, values.data(), sizeof(int32_t));
+        }
+    };
+
+    TARGET_AVX512 static __m512i getProjection(__m512i normal_x, __m512i normal_y, __m512i begin_x, __m512i begin_y,
+        __m512i x, __m512i y)
+    {
+        return _mm512_add_epi32(
+            _mm512_mullo_epi32(normal_x, _mm512_sub_epi32(x, begin_x)),
+            _mm512_mullo_epi32(normal_y, _mm512_sub_epi32(y, begin_y)));
+    }
+
+    TARGET_AVX512 static __mmask16 areShadowsIntersected(__mmask16 mask, __m512i begin, __m512i end,
+        __m512i p1, __m512i p2, __m512i p3)
+    {
+        __m512i shadow_begin = _mm512_min_epi32(_mm512_min_epi32(p1, p2), p3);
+        __m512i shadow_end = _mm512_max_epi32(_mm512_max_epi32(p1, p2), p3);
+        mask = _mm512_mask_cmp_epi32_mask(mask, begin, shadow_end, _MM_CMPINT_LE);
+        return _mm512_mask_cmp_epi32_mask(mask, end, shadow_begin, _MM_CMPINT_NLT);
+    }
+
+    template<class Loader>
+    TARGET_AVX512 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const Loader& loader,
+        __mmask16 lanes_mask, Task::PairCheckStats& stats)
+    {
+        const auto& t = triangles;
+        stats.checked += countBits(lanes_mask);
+
+        // the bounding boxes
+        __mmask16 mask = _mm512_mask_cmp_ps_mask(lanes_mask,
+            _mm512_set1_ps(t.min_x[i]), loader.load(t.max_x), _CMP_LE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_set1_ps(t.max_x[i]), loader.load(t.min_x), _CMP_GE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_set1_ps(t.min_y[i]), loader.load(t.max_y), _CMP_LE_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_set1_ps(t.max_y[i]), loader.load(t.min_y), _CMP_GE_OQ);
+        const __mmask16 boxes_mask = mask;
+        countRejected(stats.rejected_by_bounding_boxes, lanes_mask, boxes_mask);
+        if (boxes_mask == 0)
+        {
+            return 0;
+        }
+
+        const __m512i x[3] = { loader.load(t.grid_x[0]), loader.load(t.grid_x[1]), loader.load(t.grid_x[2]) };
+        const __m512i y[3] = { loader.load(t.grid_y[0]), loader.load(t.grid_y[1]), loader.load(t.grid_y[2]) };
+
+        // the sides of the triangle i
+        for (int side = 0; side < 3; ++side)
+        {
+            const auto grid_side = t.getGridSide(i, side);
+            const __m512i normal_x_i = _mm512_set1_epi32(static_cast<int32_t>(grid_side.normal_x));
+            const __m512i normal_y_i = _mm512_set1_epi32(static_cast<int32_t>(grid_side.normal_y));
+            const __m512i begin_x_i = _mm512_set1_epi32(static_cast<int32_t>(grid_side.begin_x));
+            const __m512i begin_y_i = _mm512_set1_epi32(static_cast<int32_t>(grid_side.begin_y));
+            mask = areShadowsIntersected(mask,
+                _mm512_set1_epi32(static_cast<int32_t>(grid_side.shadow_begin)),
+                _mm512_set1_epi32(static_cast<int32_t>(grid_side.shadow_end)),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[0], y[0]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[1], y[1]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[2], y[2]));
+        }
+        const __mmask16 first_mask = mask;
+        countRejected(stats.rejected_by_first_triangle, boxes_mask, first_mask);
+        if (first_mask == 0)
+        {
+            return 0;
+        }
+
+        // the sides of the other triangles, their shadows are calculated here
+        const __m512i x_i[3] = { _mm512_set1_epi32(t.grid_x[0][i]), _mm512_set1_epi32(t.grid_x[1][i]),
+            _mm512_set1_epi32(t.grid_x[2][i]) };
+        const __m512i y_i[3] = { _mm512_set1_epi32(t.grid_y[0][i]), _mm512_set1_epi32(t.grid_y[1][i]),
+            _mm512_set1_epi32(t.grid_y[2][i]) };
+        for (int side = 0; side < 3; ++side)
+        {
+            const int next = (side + 1) % 3;
+            const int last = (side + 2) % 3;
+            const __m512i normal_x_j = _mm512_sub_epi32(y[side], y[next]);
+            const __m512i normal_y_j = _mm512_sub_epi32(x[next], x[side]);
+            const __m512i projection_of_third_point =
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x[last], y[last]);
+            mask = areShadowsIntersected(mask,
+                _mm512_min_epi32(projection_of_third_point, _mm512_setzero_si512()),
+                _mm512_max_epi32(projection_of_third_point, _mm512_setzero_si512()),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[0], y_i[0]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[1], y_i[1]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[2], y_i[2]));
+        }
+        countRejected(stats.rejected_by_second_triangle, first_mask, mask);
+
+        return mask;
+    }
+};
+
+
+// AVX-512, 8 triangles at once, wide
+// the comparisons of the next axis are done only for the lanes not separated yet
+class Avx512WideGridKernel
+{
+public:
+    static constexpr size_t lanes_count = 8;
+
+    TARGET_AVX512 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        size_t first, size_t count, Task::PairCheckStats& stats)
+    {
+        return getIntersectionMask(triangles, i, RangeLoader{ first },
+            static_cast<__mmask8>(getLanesMask(count)), stats);
+    }
+
+    TARGET_AVX512 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i,
+        const int* candidates, size_t count, Task::PairCheckStats& stats)
+    {
+        int indices[lanes_count];
+        fillLanesIndices(indices, candidates, count);
+        return getIntersectionMask(triangles, i,
+            GatherLoader{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)) },
+            static_cast<__mmask8>(getLanesMask(count)), stats);
+    }
+
+private:
+    struct RangeLoader
+    {
+        size_t first;
+
+        TARGET_AVX512 __m256 load(const AlignedVector<float>& values) const
+        {
+            return _mm256_loadu_ps(values.data() + first);
+        }
+
+        TARGET_AVX512 __m512i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm512_cvtepi32_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(values.data() + first)));
+        }
+    };
+
+    struct GatherLoader
+    {
+        __m256i indices;
+
+        TARGET_AVX512 __m256 load(const AlignedVector<float>& values) const
+        {
+            return _mm256_i32gather_ps(values.data(), indices, sizeof(float));
+        }
+
+        TARGET_AVX512 __m512i load(const AlignedVector<int32_t>& values) const
+        {
+            return _mm512_cvtepi32_epi64(_mm256_i32gather_epi32(values.data(), indices, sizeof(int32_t)));
+        }
+    };
+
+    // the differences fit into int32, so they are multiplied by the low halves of the lanes
+    TARGET_AVX512 static __m512i getProjection(__m512i normal_x, __m512i normal_y, __m512i begin_x, __m512i begin_y,
+        __m512i x, __m512i y)
+    {
+        return _mm512_add_epi64(
+            _mm512_mul_epi32(normal_x, _mm512_sub_epi64(x, begin_x)),
+            _mm512_mul_epi32(normal_y, _mm512_sub_epi64(y, begin_y)));
+    }
+
+    TARGET_AVX512 static __mmask8 areShadowsIntersected(__mmask8 mask, __m512i begin, __m512i end,
+        __m512i p1, __m512i p2, __m512i p3)
+    {
+        __m512i shadow_begin = _mm512_min_epi64(_mm512_min_epi64(p1, p2), p3);
+        __m512i shadow_end = _mm512_max_epi64(_mm512_max_epi64(p1, p2), p3);
+        mask = _mm512_mask_cmp_epi64_mask(mask, begin, shadow_end, _MM_CMPINT_LE);
+        return _mm512_mask_cmp_epi64_mask(mask, end, shadow_begin, _MM_CMPINT_NLT);
+    }
+
+    template<class Loader>
+    TARGET_AVX512 static int getIntersectionMask(const PreparedTriangles& triangles, size_t i, const Loader& loader,
+        __mmask8 lanes_mask, Task::PairCheckStats& stats)
+    {
+        const auto& t = triangles;
+        stats.checked += countBits(lanes_mask);
+
+        // the bounding boxes, in a half of a register
+        const __m256 boxes = _mm256_and_ps(
+            _mm256_and_ps(
+                _mm256_cmp_ps(_mm256_set1_ps(t.min_x[i]), loader.load(t.max_x), _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_set1_ps(t.max_x[i]), loader.load(t.min_x), _CMP_GE_OQ)),
+            _mm256_and_ps(
+                _mm256_cmp_ps(_mm256_set1_ps(t.min_y[i]), loader.load(t.max_y), _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_set1_ps(t.max_y[i]), loader.load(t.min_y), _CMP_GE_OQ)));
+        __mmask8 mask = static_cast<__mmask8>(_mm256_movemask_ps(boxes) & lanes_mask);
+        const __mmask8 boxes_mask = mask;
+        countRejected(stats.rejected_by_bounding_boxes, lanes_mask, boxes_mask);
+        if (boxes_mask == 0)
+        {
+            return 0;
+        }
+
+        const __m512i x[3] = { loader.load(t.grid_x[0]), loader.load(t.grid_x[1]), loader.load(t.grid_x[2]) };
+        const __m512i y[3] = { loader.load(t.grid_y[0]), loader.load(t.grid_y[1]), loader.load(t.grid_y[2]) };
+
+        // the sides of the triangle i
+        for (int side = 0; side < 3; ++side)
+        {
+            const auto grid_side = t.getGridSide(i, side);
+            const __m512i normal_x_i = _mm512_set1_epi64(grid_side.normal_x);
+            const __m512i normal_y_i = _mm512_set1_epi64(grid_side.normal_y);
+            const __m512i begin_x_i = _mm512_set1_epi64(grid_side.begin_x);
+            const __m512i begin_y_i = _mm512_set1_epi64(grid_side.begin_y);
+            mask = areShadowsIntersected(mask,
+                _mm512_set1_epi64(grid_side.shadow_begin), _mm512_set1_epi64(grid_side.shadow_end),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[0], y[0]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[1], y[1]),
+                getProjection(normal_x_i, normal_y_i, begin_x_i, begin_y_i, x[2], y[2]));
+        }
+        const __mmask8 first_mask = mask;
+        countRejected(stats.rejected_by_first_triangle, boxes_mask, first_mask);
+        if (first_mask == 0)
+        {
+            return 0;
+        }
+
+        // the sides of the other triangles, their shadows are calculated here
+        const __m512i x_i[3] = { _mm512_set1_epi64(t.grid_x[0][i]), _mm512_set1_epi64(t.grid_x[1][i]),
+            _mm512_set1_epi64(t.grid_x[2][i]) };
+        const __m512i y_i[3] = { _mm512_set1_epi64(t.grid_y[0][i]), _mm512_set1_epi64(t.grid_y[1][i]),
+            _mm512_set1_epi64(t.grid_y[2][i]) };
+        for (int side = 0; side < 3; ++side)
+        {
+            const int next = (side + 1) % 3;
+            const int last = (side + 2) % 3;
+            const __m512i normal_x_j = _mm512_sub_epi64(y[side], y[next]);
+            const __m512i normal_y_j = _mm512_sub_epi64(x[next], x[side]);
+            const __m512i projection_of_third_point =
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x[last], y[last]);
+            mask = areShadowsIntersected(mask,
+                _mm512_min_epi64(projection_of_third_point, _mm512_setzero_si512()),
+                _mm512_max_epi64(projection_of_third_point, _mm512_setzero_si512()),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[0], y_i[0]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[1], y_i[1]),
+                getProjection(normal_x_j, normal_y_j, x[side], y[side], x_i[2], y_i[2]));
+        }
+        countRejected(stats.rejected_by_second_triangle, first_mask, mask);
+
+        return mask;
+    }
+};
+
+
+// instruction sets supported by the processor and enabled by the OS
+struct CpuFeatures
+{
+    bool sse41 = false;
+    bool avx2 = false;
+    bool avx512 = false;
+
+    static CpuFeatures detect()
+    {
+        CpuFeatures features;
+
+        unsigned int registers[4]; // eax, ebx, ecx, edx
+        getCpuid(0, registers);
+        const unsigned int max_leaf = registers[0];
+
+        getCpuid(1, registers);
+        features.sse41 = (registers[2] & (1u << 19)) != 0;
+        const bool os_saves_registers = (registers[2] & (1u << 27)) != 0;
+        if (!os_saves_registers || max_leaf < 7)
+        {
+            return features;
+        }
+
+        // the OS must save the upper halves of ymm registers (bits 1, 2) and zmm registers with masks (bits 5-7)
+        const uint64_t enabled_registers = getEnabledRegisters();
+        const bool os_saves_ymm = (enabled_registers & 0x06) == 0x06;
+        const bool os_saves_zmm = (enabled_registers & 0xe6) == 0xe6;
+
+        getCpuid(7, registers);
+        features.avx2 = os_saves_ymm && (registers[1] & (1u << 5)) != 0;
+        features.avx512 = os_saves_zmm && (registers[1] & (1u << 16)) != 0;
+        return features;
+    }
+
+private:
+    static void getCpuid(int leaf, unsigned int (&registers)[4])
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuidex(info, leaf, 0);
+        for (int k = 0; k < 4; ++k)
+        {
+            registers[k] = static_cast<unsigned int>(info[k]);
+        }
+#else
+        __cpuid_count(leaf, 0, registers[0], registers[1], registers[2], registers[3]);
+#endif
+    }
+
+    // the XCR0 register
+    static uint64_t getEnabledRegisters()
+    {
+#if defined(_MSC_VER)
+        return _xgetbv(0);
+#else
+        uint32_t eax, edx;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+    }
+};
+
+
+// one of the kernels, chosen once for the running processor
+struct PairKernel
+{
+    const char* name;
+    size_t lanes_count;
+    int (*getRangeIntersectionMask)(const PreparedTriangles&, size_t, size_t, size_t, Task::PairCheckStats&);
+    int (*getCandidatesIntersectionMask)(const PreparedTriangles&, size_t, const int*, size_t, Task::PairCheckStats&);
+
+    // the widest supported kernel, or the one named by the TASK_PAIR_KERNEL environment variable
+    // (scalar, sse4.1, avx2, avx512) if the processor supports it
+    static const PairKernel& get()
+    {
+        static const PairKernel& kernel = select();
+        return kernel;
+    }
+
+    // the scalar kernel with exact signs of the projections, whatever the processor
+    static const PairKernel& getExact()
+    {
+        static const PairKernel kernel = make<ExactKernel>("exact");
+        return kernel;
+    }
+
+    // the widest supported kernel on the grid, narrow or wide (see GridMapping), chosen the same way as get()
+    static const PairKernel& getOnGrid(bool is_narrow)
+    {
+        static const PairKernel& narrow_kernel = selectOnGrid(true);
+        static const PairKernel& wide_kernel = selectOnGrid(false);
+        return is_narrow ? narrow_kernel : wide_kernel;
+    }
+
+private:
+    template<class Kernel>
+    static PairKernel make(const char* name)
+    {
+        return {
+                name,
+                Kernel::lanes_count,
+                &Kernel::getIntersectionMask,
+                &Kernel::getIntersectionMask
+        };
+    }
+
+    static const PairKernel& select()
+    {
+        // from the widest to the narrowest
+        static const PairKernel kernels[] = {
+                make<Avx512Kernel>("avx512"),
+                make<Avx2Kernel>("avx2"),
+                make<SseKernel>("sse4.1"),
+                make<ScalarKernel>("scalar")
+        };
+
+        const auto features = CpuFeatures::detect();
+        const bool supported[] = { features.avx512, features.avx2, features.sse41, true };
+        return selectSupported(kernels, supported);
+    }
+
+    static const PairKernel& selectOnGrid(bool is_narrow)
+    {
+        static const PairKernel narrow_kernels[] = {
+                make<Avx512GridKernel>("avx512"),
+                make<Avx2GridKernel>("avx2"),
+                make<SseGridKernel>("sse4.1"),
+                make<ScalarGridKernel>("scalar")
+        };
+
+        // SSE4.1 has no comparisons of int64
+        static const PairKernel wide_kernels[] = {
+                make<Avx512WideGridKernel>("avx512"),
+                make<Avx2WideGridKernel>("avx2"),
+                make<ScalarGridKernel>("scalar")
+        };
+
+        const auto features = CpuFeatures::detect();
+        if (is_narrow)
+        {
+            const bool supported[] = { features.avx512, features.avx2, features.sse41, true };
+            return selectSupported(narrow_kernels, supported);
+        }
+        const bool supported[] = { features.avx512, features.avx2, true };
+        return selectSupported(wide_kernels, supported);
+    }
+
+    // the kernels go from the widest to the narrowest, the last one is always supported
+    // the requested kernel is replaced by the widest supported one not wider than it,
+    // e.g. by the scalar one if the set has no such kernel (there is no sse4.1 kernel of int64)
+    template<size_t KernelsCount>
+    static const PairKernel& selectSupported(const PairKernel (&kernels)[KernelsCount],
+        const bool (&supported)[KernelsCount])
+    {
+        const int requested_rank = getRank(std::getenv("TASK_PAIR_KERNEL"));
+        size_t best = 0;
+        while (!supported[best] || getRank(kernels[best].name) < requested_rank)
+        {
+            ++best;
+        }
+        return kernels[best];
+    }
+
+    // position of the kernel by its name among all the kernels from the widest to the narrowest,
+    // 0 for the unknown names (so they don't restrict the choice)
+    static int getRank(const char* name)
+    {
+        if (name == nullptr)
+        {
+            return 0;
+        }
+        int rank = 0;
+        for (const char* kernel_name : { "avx512", "avx2", "sse4.1", "scalar" })
+        {
+            if (std::strcmp(kernel_name, name) == 0)
+            {
+                return rank;
+            }
+            ++rank;
+        }
+        return 0;
+    }
+};
+
+
+// uniform grid over the bounding box of the whole scene
+// every triangle is stored in all cells covered by its bounding box
+// the triangles lying in one cell (contained by it) are stored after the rest of the triangles of the cell,
+// so a triangle covering the whole cell can count them without checking them one by one
+class UniformGrid
+{
+public:
+    // where a cell is relatively to a triangle, with a margin wider than the rounding errors
+    // of the float check of the pairs and of the cell coordinates: a triangle contained by an inside cell
+    // is intersected by the float check too, and one contained by an outside cell is separated
+    enum class CellCover
+    {
+        Straddled,
+        Inside,
+        Outside
+    };
+
+    // the sides of a triangle as lines in double, oriented so the triangle is on their positive side
+    class TriangleCover
+    {
+    private:
+        struct Line
+        {
+            double normal_x; // unit
+            double normal_y;
+            double offset;
+        };
+
+        Line lines[3];
+        double margin;
+        bool is_regular = true; // false for the triangles too thin to cover anything, all cells are straddled then
+
+        // the line through the side (begin, end), with the third point of the triangle on its positive side
+        // returns false if the side is degenerate or the third point is closer to it than two margins
+        bool setLine(Line& line, const Point& begin, const Point& end, const Point& inside)
+        {
+            const double dx = static_cast<double>(end.x) - begin.x;
+            const double dy = static_cast<double>(end.y) - begin.y;
+            const double length = std::sqrt(dx * dx + dy * dy);
+            if (!(length > 0))
+            {
+                return false;
+            }
+            line = { -dy / length, dx / length, 0 };
+            line.offset = -(line.normal_x * begin.x + line.normal_y * begin.y);
+            const double inside_distance = getDistance(line, inside);
+            if (inside_distance < 0)
+            {
+                line = { -line.normal_x, -line.normal_y, -line.offset };
+            }
+            return std::abs(inside_distance) >= 2 * margin;
+        }
+
+        static double getDistance(const Line& line, const Point& point)
+        {
+            return line.normal_x * point.x + line.normal_y * point.y + line.offset;
+        }
+
+    public:
+        TriangleCover(const Triangle& tri, double margin) : margin(margin)
+        {
+            is_regular = setLine(lines[0], tri.a, tri.b, tri.c) && setLine(lines[1], tri.b, tri.c, tri.a) &&
+                setLine(lines[2], tri.c, tri.a, tri.b);
+        }
+
+        CellCover classify(double min_x, double min_y, double max_x, double max_y) const
+        {
+            if (!is_regular)
+            {
+                return CellCover::Straddled;
+            }
+            bool is_inside = true;
+            for (const auto& line : lines)
+            {
+                // the corners nearest to the line and farthest from it along its normal
+                const double near_distance = line.offset +
+                    line.normal_x * (line.normal_x > 0 ? min_x : max_x) +
+                    line.normal_y * (line.normal_y > 0 ? min_y : max_y);
+                const double far_distance = line.offset +
+                    line.normal_x * (line.normal_x > 0 ? max_x : min_x) +
+                    line.normal_y * (line.normal_y > 0 ? max_y : min_y);
+                if (far_distance <= -margin)
+                {
+                    return CellCover::Outside;
+                }
+                is_inside = is_inside && near_distance >= margin;
+            }
+            return is_inside ? CellCover::Inside : CellCover::Straddled;
+        }
+    };
+
+private:
+    struct CellRange
+    {
+        int begin_x;
+        int begin_y;
+        int end_x; // inclusive
+        int end_y; // inclusive
+    };
+
+    float origin_x = 0;
+    float origin_y = 0;
+    float inv_cell_width = 0;
+    float inv_cell_height = 0;
+    int cells_x = 1;
+    int cells_y = 1;
+    double cover_margin = 0; // 0 if the cells are not classified
+    double cell_width = 0;   // the borders of the cells are where getCellCoordinate changes
+    double cell_height = 0;
+    static constexpr int min_classified_cells = 16;
+    bool has_covering_triangles = false; // some triangles classify the cells
+
+    // triangles of the cell k are cell_items[cell_begin[k]..cell_begin[k + 1]),
+    // the ones contained by the cell are cell_items[contained_begin[k]..cell_begin[k + 1]),
+    // both parts are sorted by index
+    std::vector<int> cell_begin;
+    std::vector<int> contained_begin;
+    std::vector<int> cell_items;
+
+    static int getCellsCount(float extent, float cell_size, int max_cells)
+    {
+        if (cell_size <= 0 || extent <= 0)
+        {
+            return 1;
+        }
+        float count = std::ceil(extent / cell_size);
+        return count >= max_cells ? max_cells : std::max(1, static_cast<int>(count));
+    }
+
+    static int getCellCoordinate(float value, float origin, float inv_cell_size, int cells)
+    {
+        int coordinate = static_cast<int>((value - origin) * inv_cell_size);
+        return std::min(std::max(coordinate, 0), cells - 1);
+    }
+
+    int getCellIndex(float x, float y) const
+    {
+        return getCellCoordinate(y, origin_y, inv_cell_height, cells_y) * cells_x +
+            getCellCoordinate(x, origin_x, inv_cell_width, cells_x);
+    }
+
+    CellRange getCellRange(const BoundingBox& box) const
+    {
+        return {
+                getCellCoordinate(box.min_x, origin_x, inv_cell_width, cells_x),
+                getCellCoordinate(box.min_y, origin_y, inv_cell_height, cells_y),
+                getCellCoordinate(box.max_x, origin_x, inv_cell_width, cells_x),
+                getCellCoordinate(box.max_y, origin_y, inv_cell_height, cells_y)
+        };
+    }
+
+    static bool isSingleCell(const CellRange& range)
+    {
+        return range.begin_x == range.end_x && range.begin_y == range.end_y;
+    }
+
+    bool isClassifying(const CellRange& range) const
+    {
+        return cover_margin > 0 &&
+            (range.end_x - range.begin_x + 1) * (range.end_y - range.begin_y + 1) >= min_classified_cells;
+    }
+
+    CellCover classify(const TriangleCover& cover, int x, int y) const
+    {
+        return cover.classify(origin_x + x * cell_width, origin_y + y * cell_height,
+            origin_x + (x + 1) * cell_width, origin_y + (y + 1) * cell_height);
+    }
+
+    void setCoverMargin(const BoundingBox& scene)
+    {
+        // the float check projects the differences of the coordinates (up to twice the largest magnitude)
+        // on the normals, with a few rounding errors of the products and the sums; the cell coordinates
+        // have about the same error, so 64 epsilons of the largest magnitude cover both with a wide reserve
+        // the scenes so small that the products of the differences get close to the denormals have no margin,
+        // as well as the grids of zero width or height
+        const double magnitude = std::max({ std::abs(scene.min_x), std::abs(scene.min_y),
+            std::abs(scene.max_x), std::abs(scene.max_y) });
+        const double margin = 64 * std::numeric_limits<float>::epsilon() * magnitude;
+        const bool is_classified = inv_cell_width > 0 && inv_cell_height > 0 &&
+            margin * margin > 1024 * std::numeric_limits<float>::min() &&
+            std::isfinite(margin);
+        cover_margin = is_classified ? margin : 0;
+        cell_width = is_classified ? 1.0 / inv_cell_width : 0;
+        cell_height = is_classified ? 1.0 / inv_cell_height : 0;
+    }
+
+public:
+    void build(const std::vector<BoundingBox>& boxes)
+    {
+        const int triangles_count = static_cast<int>(boxes.size());
+
+        BoundingBox scene = boxes.front();
+        float extents_sum = 0;
+        for (const auto& box : boxes)
+        {
+            scene.min_x = std::min(scene.min_x, box.min_x);
+            scene.min_y = std::min(scene.min_y, box.min_y);
+            scene.max_x = std::max(scene.max_x, box.max_x);
+            scene.max_y = std::max(scene.max_y, box.max_y);
+            extents_sum += std::max(box.max_x - box.min_x, box.max_y - box.min_y);
+        }
+        const float width = scene.max_x - scene.min_x;
+        const float height = scene.max_y - scene.min_y;
+
+        // a cell should fit an average triangle, but the grid shouldn't have more cells than triangles
+        // (the second condition bounds the number of cells by 3 * triangles_count + 1)
+        const float cell_size = std::max(
+            extents_sum / static_cast<float>(triangles_count),
+            std::sqrt(width * height / static_cast<float>(triangles_count)));
+
+        cells_x = getCellsCount(width, cell_size, triangles_count);
+        cells_y = getCellsCount(height, cell_size, triangles_count);
+        origin_x = scene.min_x;
+        origin_y = scene.min_y;
+        inv_cell_width = width > 0 ? static_cast<float>(cells_x) / width : 0;
+        inv_cell_height = height > 0 ? static_cast<float>(cells_y) / height : 0;
+        setCoverMargin(scene);
+
+        // counting sort of (cell, triangle) entries, the contained triangles are counted separately
+        const size_t cells_count = static_cast<size_t>(cells_x) * cells_y;
+        cell_begin.assign(cells_count + 1, 0);
+        std::vector<int> contained_counts(cells_count, 0);
+        has_covering_triangles = false;
+        for (const auto& box : boxes)
+        {
+            auto range = getCellRange(box);
+            has_covering_triangles = has_covering_triangles || isClassifying(range);
+            if (isSingleCell(range))
+            {
+                contained_counts[range.begin_y * cells_x + range.begin_x]++;
+            }
+            for (int y = range.begin_y; y <= range.end_y; ++y)
+            {
+                for (int x = range.begin_x; x <= range.end_x; ++x)
+                {
+                    cell_begin[y * cells_x + x + 1]++;
+                }
+            }
+        }
+        for (size_t k = 1; k < cell_begin.size(); ++k)
+        {
+            cell_begin[k] += cell_begin[k - 1];
+        }
+        contained_begin.resize(cells_count);
+        for (size_t k = 0; k < cells_count; ++k)
+        {
+            contained_begin[k] = cell_begin[k + 1] - contained_counts[k];
+        }
+
+        cell_items.resize(cell_begin.back());
+        std::vector<int> cell_fill(cell_begin.begin(), cell_begin.end() - 1);
+        std::vector<int> contained_fill(contained_begin);
+        for (int i = 0; i < triangles_count; ++i)
+        {
+            auto range = getCellRange(boxes[i]);
+            if (isSingleCell(range))
+            {
+                cell_items[contained_fill[range.begin_y * cells_x + range.begin_x]++] = i;
+                continue;
+            }
+            for (int y = range.begin_y; y <= range.end_y; ++y)
+            {
+                for (int x = range.begin_x; x <= range.end_x; ++x)
+                {
+                    cell_items[cell_fill[y * cells_x + x]++] = i;
+                }
+            }
+        }
+    }
+
+    int getCellsCount() const
+    {
+        return cells_x * cells_y;
+    }
+
+    // false if no triangle is large enough to classify the cells, they are all straddled then
+    bool hasCoveringTriangles() const
+    {
+        return has_covering_triangles;
+    }
+
+    // positions of the items, see getItem
+    size_t getItemsCount() const
+    {
+        return cell_items.size();
+    }
+
+    int getItem(size_t position) const
+    {
+        return cell_items[position];
+    }
+
+    // the positions of the triangles contained by the cell
+    size_t getContainedBegin(int cell) const
+    {
+        return contained_begin[cell];
+    }
+
+    size_t getContainedEnd(int cell) const
+    {
+        return cell_begin[cell + 1];
+    }
+
+    // calls fn(j) once for every triangle j > i whose bounding box intersects the box of i
+    // a pair sharing several cells is reported only from the cell
+    // containing the lower left corner of the intersection of their boxes
+    template<class Fn>
+    void forEachCandidate(int i, const std::vector<BoundingBox>& boxes, Fn&& fn) const
+    {
+        const auto& box_i = boxes[i];
+        forEachCell(box_i, [&](int cell, const int*, const int*)
+        {
+            forEachCandidateInRange(i, boxes, cell, cell_begin[cell], contained_begin[cell], fn);
+            forEachCandidateInRange(i, boxes, cell, contained_begin[cell], cell_begin[cell + 1], fn);
+        });
+    }
+
+    // same as forEachCandidate, but the triangles contained by the cells classified relatively to the triangle i
+    // are not reported: the ones in the outside cells are skipped, and the ones in the inside cells
+    // are passed to onCovered(begin, end) as the range of their positions (see getItem)
+    // only the triangles whose boxes span min_classified_cells or more classify them,
+    // the smaller ones can hardly cover a cell
+    template<class Fn, class OnCovered>
+    void forEachCandidate(int i, const Triangle& tri, const std::vector<BoundingBox>& boxes, Fn&& fn,
+        OnCovered&& onCovered) const
+    {
+        const auto& box_i = boxes[i];
+        const auto range = getCellRange(box_i);
+        if (!isClassifying(range))
+        {
+            forEachCandidate(i, boxes, fn);
+            return;
+        }
+
+        const TriangleCover cover(tri, cover_margin);
+        for (int y = range.begin_y; y <= range.end_y; ++y)
+        {
+            for (int x = range.begin_x; x <= range.end_x; ++x)
+            {
+                const int cell = y * cells_x + x;
+                forEachCandidateInRange(i, boxes, cell, cell_begin[cell], contained_begin[cell], fn);
+
+                const int* contained_items = cell_items.data() + contained_begin[cell];
+                const int* contained_end = cell_items.data() + cell_begin[cell + 1];
+                if (contained_items == contained_end)
+                {
+                    continue;
+                }
+                switch (classify(cover, x, y))
+                {
+                case CellCover::Straddled:
+                    forEachCandidateInRange(i, boxes, cell, contained_begin[cell], cell_begin[cell + 1], fn);
+                    break;
+                case CellCover::Inside:
+                    {
+                        const int* first = std::upper_bound(contained_items, contained_end, i);
+                        if (first != contained_end)
+                        {
+                            onCovered(first - cell_items.data(), contained_end - cell_items.data());
+                        }
+                    }
+                    break;
+                case CellCover::Outside:
+                    break;
+                }
+            }
+        }
+    }
+
+    // calls fn(j) for the triangles j > i from cell_items[begin..end) of the cell, sorted by index,
+    // whose pairs with i are reported from the cell
+    template<class Fn>
+    void forEachCandidateInRange(int i, const std::vector<BoundingBox>& boxes, int cell, int begin, int end,
+        Fn&& fn) const
+    {
+        const auto& box_i = boxes[i];
+        const int* items_end = cell_items.data() + end;
+        const int* item = std::upper_bound(cell_items.data() + begin, items_end, i);
+        for (; item != items_end; ++item)
+        {
+            const int j = *item;
+            const auto& box_j = boxes[j];
+            if (BoundingBox::areIntersected(box_i, box_j) && isPairCell(box_i, box_j, cell))
+            {
+                fn(j);
+            }
+        }
+    }
+
+    // calls fn(cell, items_begin, items_end) for every cell covered by the box
+    template<class Fn>
+    void forEachCell(const BoundingBox& box, Fn&& fn) const
+    {
+        auto range = getCellRange(box);
+        for (int y = range.begin_y; y <= range.end_y; ++y)
+        {
+            for (int x = range.begin_x; x <= range.end_x; ++x)
+            {
+                const int cell = y * cells_x + x;
+                fn(cell, cell_items.data() + cell_begin[cell], cell_items.data() + cell_begin[cell + 1]);
+            }
+        }
+    }
+
+    // true if the pair of triangles with intersecting boxes is reported from the cell
+    bool isPairCell(const BoundingBox& box_i, const BoundingBox& box_j, int cell) const
+    {
+        return getCellIndex(std::max(box_i.min_x, box_j.min_x), std::max(box_i.min_y, box_j.min_y)) == cell;
+    }
+};
+
+
+// loose grids of several levels over the bounding box of the whole scene,
+// the cells of every level are twice as large as the cells of the previous one
+// every triangle is stored once: on the finest level whose cells aren't smaller than its bounding box,
+// in the cell containing the lower left corner of the box (so the box sticks out of the cell by less than a cell)
+// a triangle is checked only against its own level and the coarser ones
+// the cells are filled by a counting sort, with all the threads inserting their portions of the triangles at once
+class HierarchicalGrid
+{
+private:
+    struct Level
+    {
+        float cell_size;
+        float inv_cell_size;
+        int cells_x;
+        int cells_y;
+        int first_cell;
+    };
+
+    float origin_x = 0;
+    float origin_y = 0;
+    std::vector<Level> levels;
+    std::vector<int> triangle_levels;
+    std::vector<int> triangle_cells;
+
+    // triangles of the cell k are cell_items[cell_begin[k]..cell_begin[k + 1])
+    // cell_fill holds the sizes of the cells first, then the positions where their next triangles go
+    std::vector<int> cell_begin;
+    std::vector<std::atomic<int>> cell_fill;
+    std::vector<int> cell_items;
+
+    static int getCellCoordinate(float value, float origin, float inv_cell_size, int cells)
+    {
+        int coordinate = static_cast<int>((value - origin) * inv_cell_size);
+        return std::min(std::max(coordinate, 0), cells - 1);
+    }
+
+public:
+    void prepare(const std::vector<BoundingBox>& boxes)
+    {
+        const size_t triangles_count = boxes.size();
+
+        BoundingBox scene = boxes.front();
+        for (const auto& box : boxes)
+        {
+            scene = BoundingBox::getUnion(scene, box);
+        }
+        const float width = scene.max_x - scene.min_x;
+        const float height = scene.max_y - scene.min_y;
+        const float scene_size = std::max(width, height);
+        origin_x = scene.min_x;
+        origin_y = scene.min_y;
+
+        // the finest level has about as many cells as there are triangles, the coarsest one covers the whole scene
+        float cell_size = std::max(
+            std::sqrt(width * height / static_cast<float>(triangles_count)),
+            scene_size / static_cast<float>(triangles_count));
+        if (cell_size <= 0)
+        {
+            cell_size = 1;
+        }
+
+        levels.clear();
+        int cells_count = 0;
+        while (true)
+        {
+            Level level;
+            level.cell_size = cell_size;
+            level.inv_cell_size = 1 / cell_size;
+            level.cells_x = static_cast<int>(std::min<float>(width * level.inv_cell_size, triangles_count)) + 1;
+            level.cells_y = static_cast<int>(std::min<float>(height * level.inv_cell_size, triangles_count)) + 1;
+            level.first_cell = cells_count;
+            levels.push_back(level);
+            cells_count += level.cells_x * level.cells_y;
+            if (cell_size >= scene_size)
+            {
+                break;
+            }
+            cell_size *= 2;
+        }
+
+        triangle_levels.resize(triangles_count);
+        triangle_cells.resize(triangles_count);
+        cell_begin.resize(cells_count + 1);
+        cell_begin.back() = static_cast<int>(triangles_count);
+        cell_fill = std::vector<std::atomic<int>>(cells_count);
+        cell_items.resize(triangles_count);
+    }
+
+    size_t getCellsCount() const
+    {
+        return cell_fill.size();
+    }
+
+    // finds the cells of the triangles [begin, end) and counts them in the sizes of the cells
+    void count(const std::vector<BoundingBox>& boxes, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const auto& box = boxes[i];
+            const float size = std::max(box.max_x - box.min_x, box.max_y - box.min_y);
+            int level_index = 0;
+            while (level_index + 1 < static_cast<int>(levels.size()) && size > levels[level_index].cell_size)
+            {
+                ++level_index;
+            }
+
+            const auto& level = levels[level_index];
+            const int cell = level.first_cell +
+                getCellCoordinate(box.min_y, origin_y, level.inv_cell_size, level.cells_y) * level.cells_x +
+                getCellCoordinate(box.min_x, origin_x, level.inv_cell_size, level.cells_x);
+            triangle_levels[i] = level_index;
+            triangle_cells[i] = cell;
+            cell_fill[cell].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // number of the triangles in the cells [begin, end)
+    int getCellsSize(size_t begin, size_t end) const
+    {
+        int size = 0;
+        for (size_t cell = begin; cell < end; ++cell)
+        {
+            size += cell_fill[cell].load(std::memory_order_relaxed);
+        }
+        return size;
+    }
+
+    // turns the sizes of the cells [begin, end) into their positions, items_begin is the position of the cell begin
+    void placeCells(size_t begin, size_t end, int items_begin)
+    {
+        for (size_t cell = begin; cell < end; ++cell)
+        {
+            cell_begin[cell] = items_begin;
+            items_begin += cell_fill[cell].load(std::memory_order_relaxed);
+            cell_fill[cell].store(cell_begin[cell], std::memory_order_relaxed);
+        }
+    }
+
+    // puts the triangles [begin, end) into their cells
+    void fill(size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            cell_items[cell_fill[triangle_cells[i]].fetch_add(1, std::memory_order_relaxed)] = static_cast<int>(i);
+        }
+    }
+
+    // calls fn(j) once for every triangle j whose bounding box intersects the box of i,
+    // with j from a coarser level, or from the same level and j > i
+    template<class Fn>
+    void forEachCandidate(int i, const std::vector<BoundingBox>& boxes, Fn&& fn) const
+    {
+        const auto& box_i = boxes[i];
+        for (size_t level_index = triangle_levels[i]; level_index < levels.size(); ++level_index)
+        {
+            const auto& level = levels[level_index];
+            if (cell_begin[level.first_cell] == cell_begin[level.first_cell + level.cells_x * level.cells_y])
+            {
+                continue;
+            }
+            const int min_j = static_cast<int>(level_index) == triangle_levels[i] ? i + 1 : 0;
+
+            // the lower left corners of the boxes intersecting the box of i are at most a cell away from it
+            const int begin_x = getCellCoordinate(box_i.min_x - level.cell_size, origin_x, level.inv_cell_size,
+                level.cells_x);
+            const int begin_y = getCellCoordinate(box_i.min_y - level.cell_size, origin_y, level.inv_cell_size,
+                level.cells_y);
+            const int end_x = getCellCoordinate(box_i.max_x, origin_x, level.inv_cell_size, level.cells_x);
+            const int end_y = getCellCoordinate(box_i.max_y, origin_y, level.inv_cell_size, level.cells_y);
+            for (int y = begin_y; y <= end_y; ++y)
+            {
+                for (int x = begin_x; x <= end_x; ++x)
+                {
+                    const int cell = level.first_cell + y * level.cells_x + x;
+                    for (int k = cell_begin[cell]; k < cell_begin[cell + 1]; ++k)
+                    {
+                        const int j = cell_items[k];
+                        if (j >= min_j && BoundingBox::areIntersected(box_i, boxes[j]))
+                        {
+                            fn(j);
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+
+
+// bounding volume hierarchy over the boxes of the triangles, the nodes are split by binned SAH
+// (with the half perimeter of a box as the cost, it's what the area is for 3D boxes)
+// the top levels are built by one thread, the subtrees below them are built by all the threads
+// the node splitting items at the position m has children 2 * m - 1 and 2 * m,
+// such positions are unique, so the subtrees need no shared counter of nodes
+class BoundingVolumeHierarchy
+{
+public:
+    // pair of nodes whose triangles are checked against each other, or a node checked against itself
+    struct Traversal
+    {
+        int node1;
+        int node2;
+    };
+
+private:
+    static constexpr int max_leaf_size = 4;
+    static constexpr int bins_count = 16;
+
+    struct Node
+    {
+        BoundingBox box;
+        int first; // items[first..first + count) of a leaf, the first child of an internal node
+        int count; // 0 for internal nodes
+    };
+
+    struct Bin
+    {
+        BoundingBox box;
+        int count;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> items;
+    std::vector<int> subtrees; // nodes left as leaves by the top levels, to be split by buildSubtree
+
+    static float getCenter(const BoundingBox& box, int axis)
+    {
+        return axis == 0 ? 0.5f * (box.min_x + box.max_x) : 0.5f * (box.min_y + box.max_y);
+    }
+
+    static int getBin(float center, float begin, float scale)
+    {
+        return std::min(std::max(static_cast<int>((center - begin) * scale), 0), bins_count - 1);
+    }
+
+    BoundingBox getItemsBox(int first, int count, const std::vector<BoundingBox>& boxes) const
+    {
+        BoundingBox box = boxes[items[first]];
+        for (int k = first + 1; k < first + count; ++k)
+        {
+            box = BoundingBox::getUnion(box, boxes[items[k]]);
+        }
+        return box;
+    }
+
+    // reorders the items of the node and returns the number of them going to the first child
+    int partition(const Node& node, const std::vector<BoundingBox>& boxes)
+    {
+        int* begin = items.data() + node.first;
+        int* end = begin + node.count;
+
+        float centers_begin[2] = { getCenter(boxes[*begin], 0), getCenter(boxes[*begin], 1) };
+        float centers_end[2] = { centers_begin[0], centers_begin[1] };
+        for (const int* item = begin + 1; item != end; ++item)
+        {
+            for (int axis = 0; axis < 2; ++axis)
+            {
+                centers_begin[axis] = std::min(centers_begin[axis], getCenter(boxes[*item], axis));
+                centers_end[axis] = std::max(centers_end[axis], getCenter(boxes[*item], axis));
+            }
+        }
+
+        float best_cost = std::numeric_limits<float>::infinity();
+        int best_axis = -1;
+        int best_bin = 0;
+        for (int axis = 0; axis < 2; ++axis)
+        {
+            if (centers_end[axis] <= centers_begin[axis])
+            {
+                continue;
+            }
+            const float scale = bins_count / (centers_end[axis] - centers_begin[axis]);
+
+            Bin bins[bins_count] = {};
+            for (const int* item = begin; item != end; ++item)
+            {
+                const auto& box = boxes[*item];
+                auto& bin = bins[getBin(getCenter(box, axis), centers_begin[axis], scale)];
+                bin.box = bin.count == 0 ? box : BoundingBox::getUnion(bin.box, box);
+                ++bin.count;
+            }
+
+            // costs of the second child when the split goes before the bin k
+            float second_costs[bins_count] = {};
+            BoundingBox second_box = {};
+            int second_count = 0;
+            for (int k = bins_count - 1; k > 0; --k)
+            {
+                if (bins[k].count > 0)
+                {
+                    second_box = second_count == 0 ? bins[k].box : BoundingBox::getUnion(second_box, bins[k].box);
+                    second_count += bins[k].count;
+                }
+                second_costs[k] = second_count == 0 ?
+                    std::numeric_limits<float>::infinity() :
+                    second_box.getHalfPerimeter() * second_count;
+            }
+
+            BoundingBox first_box = {};
+            int first_count = 0;
+            for (int k = 0; k < bins_count - 1; ++k)
+            {
+                if (bins[k].count > 0)
+                {
+                    first_box = first_count == 0 ? bins[k].box : BoundingBox::getUnion(first_box, bins[k].box);
+                    first_count += bins[k].count;
+                }
+                if (first_count == 0)
+                {
+                    continue;
+                }
+                const float cost = first_box.getHalfPerimeter() * first_count + second_costs[k + 1];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = k;
+                }
+            }
+        }
+
+        // all the centers coincide, any split is as good as another
+        if (best_axis < 0)
+        {
+            return node.count / 2;
+        }
+
+        const float begin_center = centers_begin[best_axis];
+        const float scale = bins_count / (centers_end[best_axis] - begin_center);
+        const int* middle = std::partition(begin, end, [&](int i)
+        {
+            return getBin(getCenter(boxes[i], best_axis), begin_center, scale) <= best_bin;
+        });
+        return static_cast<int>(middle - begin);
+    }
+
+    // splits the node and its descendants down to the leaves,
+    // the ones with no more than deferred_count triangles are not split but added to subtrees
+    void split(int root, const std::vector<BoundingBox>& boxes, int deferred_count)
+    {
+        std::vector<int> stack{ root };
+        while (!stack.empty())
+        {
+            const int index = stack.back();
+            stack.pop_back();
+
+            auto& node = nodes[index];
+            if (node.count <= max_leaf_size)
+            {
+                continue;
+            }
+            if (node.count <= deferred_count)
+            {
+                subtrees.push_back(index);
+                continue;
+            }
+
+            const int first_count = partition(node, boxes);
+            const int middle = node.first + first_count;
+            nodes[2 * middle - 1] = { getItemsBox(node.first, first_count, boxes), node.first, first_count };
+            nodes[2 * middle] = { getItemsBox(middle, node.count - first_count, boxes), middle,
+                    node.count - first_count };
+            node.first = 2 * middle - 1;
+            node.count = 0;
+
+            stack.push_back(2 * middle - 1);
+            stack.push_back(2 * middle);
+        }
+    }
+
+    bool isLeaf(int index) const
+    {
+        return nodes[index].count > 0;
+    }
+
+    // appends to candidates the triangles of all the leaves of the node whose boxes intersect the box
+    void collectItems(const BoundingBox& box, int root, std::vector<int>& candidates, std::vector<int>& stack) const
+    {
+        stack.assign(1, root);
+        while (!stack.empty())
+        {
+            const auto& node = nodes[stack.back()];
+            stack.pop_back();
+            if (!BoundingBox::areIntersected(box, node.box))
+            {
+                continue;
+            }
+            if (node.count > 0)
+            {
+                candidates.insert(candidates.end(), items.begin() + node.first,
+                    items.begin() + node.first + node.count);
+            }
+            else
+            {
+                stack.push_back(node.first);
+                stack.push_back(node.first + 1);
+            }
+        }
+    }
+
+public:
+    // appends to candidates the triangles of all the leaves whose boxes intersect the box
+    void collectItems(const BoundingBox& box, std::vector<int>& candidates, std::vector<int>& stack) const
+    {
+        collectItems(box, 0, candidates, stack);
+    }
+
+    // builds the top levels, down to the subtrees of no more than subtree_size triangles
+    void buildTop(const std::vector<BoundingBox>& boxes, size_t subtree_size)
+    {
+        const int triangles_count = static_cast<int>(boxes.size());
+        items.resize(triangles_count);
+        for (int i = 0; i < triangles_count; ++i)
+        {
+            items[i] = i;
+        }
+        nodes.resize(2 * triangles_count - 1);
+        nodes[0] = { getItemsBox(0, triangles_count, boxes), 0, triangles_count };
+
+        subtrees.clear();
+        split(0, boxes, static_cast<int>(subtree_size));
+    }
+
+    size_t getSubtreesCount() const
+    {
+        return subtrees.size();
+    }
+
+    // the subtrees don't share nodes, so they can be built simultaneously
+    void buildSubtree(size_t subtree, const std::vector<BoundingBox>& boxes)
+    {
+        split(subtrees[subtree], boxes, 0);
+    }
+
+    // splits the traversal of the whole tree into at least min_count independent traversals, if the top levels allow it
+    // every pair of triangles with intersecting boxes belongs to exactly one of them
+    std::vector<Traversal> getTraversals(size_t min_count) const
+    {
+        std::vector<Traversal> traversals{ { 0, 0 } };
+        std::vector<Traversal> next;
+        bool is_split = true;
+        while (is_split && traversals.size() < min_count)
+        {
+            is_split = false;
+            next.clear();
+            for (const auto& traversal : traversals)
+            {
+                const int node1 = traversal.node1;
+                const int node2 = traversal.node2;
+                if (node1 == node2)
+                {
+                    if (isLeaf(node1))
+                    {
+                        next.push_back(traversal);
+                        continue;
+                    }
+                    const int child = nodes[node1].first;
+                    next.push_back({ child, child });
+                    next.push_back({ child + 1, child + 1 });
+                    next.push_back({ child, child + 1 });
+                    is_split = true;
+                }
+                else if (!isLeaf(node1) && (isLeaf(node2) ||
+                    nodes[node1].box.getHalfPerimeter() >= nodes[node2].box.getHalfPerimeter()))
+                {
+                    const int child = nodes[node1].first;
+                    next.push_back({ child, node2 });
+                    next.push_back({ child + 1, node2 });
+                    is_split = true;
+                }
+                else if (!isLeaf(node2))
+                {
+                    const int child = nodes[node2].first;
+                    next.push_back({ node1, child });
+                    next.push_back({ node1, child + 1 });
+                    is_split = true;
+                }
+                else
+                {
+                    next.push_back(traversal);
+                }
+            }
+
+            // pairs of nodes with disjoint boxes have nothing to check
+            traversals.clear();
+            for (const auto& traversal : next)
+            {
+                if (BoundingBox::areIntersected(nodes[traversal.node1].box, nodes[traversal.node2].box))
+                {
+                    traversals.push_back(traversal);
+                }
+            }
+        }
+        return traversals;
+    }
+
+    // calls check(i) for the triangles i of the traversal,
+    // after filling candidates with the triangles to check i against
+    // the descent goes on while both nodes are internal, then the leaf is checked against the other node at once
+    template<class Check>
+    void traverse(const Traversal& root, std::vector<int>& candidates, std::vector<Traversal>& stack,
+        std::vector<int>& items_stack, Check&& check) const
+    {
+        stack.assign(1, root);
+        while (!stack.empty())
+        {
+            const auto traversal = stack.back();
+            stack.pop_back();
+
+            const auto& node1 = nodes[traversal.node1];
+            const auto& node2 = nodes[traversal.node2];
+            if (traversal.node1 == traversal.node2)
+            {
+                if (node1.count > 0)
+                {
+                    const auto leaf_begin = items.begin() + node1.first;
+                    const auto leaf_end = leaf_begin + node1.count;
+                    for (auto item = leaf_begin; item + 1 < leaf_end; ++item)
+                    {
+                        candidates.assign(item + 1, leaf_end);
+                        check(*item);
+                    }
+                }
+                else
+                {
+                    stack.push_back({ node1.first, node1.first });
+                    stack.push_back({ node1.first + 1, node1.first + 1 });
+                    stack.push_back({ node1.first, node1.first + 1 });
+                }
+                continue;
+            }
+
+            if (!BoundingBox::areIntersected(node1.box, node2.box))
+            {
+                continue;
+            }
+
+            if (node1.count > 0 || node2.count > 0)
+            {
+                const auto& leaf = node1.count > 0 ? node1 : node2;
+                candidates.clear();
+                collectItems(leaf.box, node1.count > 0 ? traversal.node2 : traversal.node1, candidates, items_stack);
+                if (!candidates.empty())
+                {
+                    for (int k = leaf.first; k < leaf.first + leaf.count; ++k)
+                    {
+                        check(items[k]);
+                    }
+                }
+            }
+            else if (node1.box.getHalfPerimeter() >= node2.box.getHalfPerimeter())
+            {
+                stack.push_back({ node1.first, traversal.node2 });
+                stack.push_back({ node1.first + 1, traversal.node2 });
+            }
+            else
+            {
+                stack.push_back({ traversal.node1, node2.first });
+                stack.push_back({ traversal.node1, node2.first + 1 });
+            }
+        }
+    }
+};
+
+
+// interval of a triangle on the sweep axis
+struct SweepEntry
+{
+    float begin;
+    float end;
+    int index;
+
+    static bool isLess(const SweepEntry& entry1, const SweepEntry& entry2)
+    {
+        return entry1.begin < entry2.begin || (entry1.begin == entry2.begin && entry1.index < entry2.index);
+    }
+};
+
+
+// results of a sweep reused by the next one, while the triangles move a little between the calls
+// the intervals are kept in their sorted order, so sorting them again takes a few moves of insertion sort,
+// and every triangle keeps the separated pairs found from its interval with the sides that separated them
+// (if the intervals of a pair swap places, the pair is found from the other one and checked as a new one)
+struct SweepCache
+{
+    static constexpr int no_side = -1;
+
+    struct CachedPair
+    {
+        int index;
+        int side;
+    };
+
+    // the pairs of a triangle are threads_pairs[thread][first..first + count)
+    struct PairsRange
+    {
+        size_t first;
+        uint32_t thread;
+        uint32_t count;
+    };
+
+    size_t triangles_count = 0; // 0 if there is nothing to reuse
+    size_t threads_count = 0;
+    bool sweep_along_x = true;
+    std::vector<SweepEntry> sweep_entries;
+
+    // the pairs of the previous call and of the current one
+    std::vector<std::vector<CachedPair>> threads_pairs[2];
+    std::vector<PairsRange> triangles_pairs[2];
+    int current = 0;
+
+    // insertion sort, fast for nearly sorted entries, falls back to std::sort if the entries moved too far
+    static void sort(std::vector<SweepEntry>& entries)
+    {
+        size_t moves_left = 16 * entries.size();
+        for (size_t k = 1; k < entries.size(); ++k)
+        {
+            const auto entry = entries[k];
+            size_t place = k;
+            while (place > 0 && SweepEntry::isLess(entry, entries[place - 1]))
+            {
+                if (moves_left == 0)
+                {
+                    entries[place] = entry;
+                    std::sort(entries.begin(), entries.end(), SweepEntry::isLess);
+                    return;
+                }
+                --moves_left;
+                entries[place] = entries[place - 1];
+                --place;
+            }
+            entries[place] = entry;
+        }
+    }
+};
+
+
+// blocks threads until all of them reach the barrier
+class Barrier
+{
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    const size_t threads_count;
+    size_t waiting_count = 0;
+    size_t generation = 0;
+
+public:
+    explicit Barrier(size_t threads_count) : threads_count(threads_count)
+    {
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto current_generation = generation;
+        if (++waiting_count == threads_count)
+        {
+            waiting_count = 0;
+            ++generation;
+            condition.notify_all();
+            return;
+        }
+        condition.wait(lock, [&] { return generation != current_generation; });
+    }
+};
+
+
+// hands out consecutive chunks of [0, count) to the threads as soon as they are free
+class ChunksCounter
+{
+private:
+    std::atomic<size_t> next_begin{ 0 };
+    size_t count = 0;
+    size_t chunk_size = 1;
+
+public:
+    void reset(size_t total_count, size_t num_of_chunks)
+    {
+        next_begin = 0;
+        count = total_count;
+        chunk_size = std::max<size_t>(1, total_count / std::max<size_t>(1, num_of_chunks));
+    }
+
+    bool getNextChunk(size_t& begin, size_t& end)
+    {
+        begin = next_begin.fetch_add(chunk_size, std::memory_order_relaxed);
+        if (begin >= count)
+        {
+            return false;
+        }
+        end = std::min(begin + chunk_size, count);
+        return true;
+    }
+};
+
+
+// adds the time spent inside its scope to the given counter (in seconds)
+class BusyTimer
+{
+private:
+    double& busy_time;
+    const std::chrono::steady_clock::time_point begin;
+
+public:
+    explicit BusyTimer(double& busy_time) : busy_time(busy_time), begin(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~BusyTimer()
+    {
+        busy_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+};
+
+
+// counters of intersections, every thread increments its own block of them
+// blocks are summed up at the end (see reduce), so the threads don't fight for the same cache lines
+// if the blocks of all the threads don't fit into max_memory, neighbour threads share a block
+// and increment it atomically
+class IntersectionCounters
+{
+public:
+    static constexpr size_t max_memory = 64 << 20;
+
+    class Block
+    {
+    private:
+        std::atomic<int>* counts = nullptr;
+        bool is_shared = false;
+
+    public:
+        Block(std::atomic<int>* counts, bool is_shared) : counts(counts), is_shared(is_shared)
+        {
+        }
+
+        // returns the new value of the counter
+        int increment(int i, int value = 1)
+        {
+            if (is_shared)
+            {
+                return counts[i].fetch_add(value, std::memory_order_relaxed) + value;
+            }
+            const int count = counts[i].load(std::memory_order_relaxed) + value;
+            counts[i].store(count, std::memory_order_relaxed);
+            return count;
+        }
+
+        // the counter of the triangle i in this block only, unless all the threads share it
+        int get(int i) const
+        {
+            return counts[i].load(std::memory_order_relaxed);
+        }
+    };
+
+private:
+    std::vector<AlignedVector<std::atomic<int>>> blocks;
+    size_t threads_per_block = 1;
+
+public:
+    // with is_single_block all the threads share one block, so every counter is always up to date
+    IntersectionCounters(size_t triangles_count, size_t num_of_threads, bool is_single_block = false)
+    {
+        const size_t block_memory = std::max<size_t>(1, triangles_count * sizeof(std::atomic<int>));
+        const size_t num_of_blocks = is_single_block ?
+            1 :
+            std::max<size_t>(1, std::min(num_of_threads, max_memory / block_memory));
+        threads_per_block = (num_of_threads + num_of_blocks - 1) / num_of_blocks;
+
+        blocks.reserve(num_of_blocks);
+        for (size_t k = 0; k < num_of_blocks; ++k)
+        {
+            blocks.emplace_back(triangles_count);
+        }
+    }
+
+    Block getBlock(size_t thread_index)
+    {
+        return { blocks[thread_index / threads_per_block].data(), threads_per_block > 1 };
+    }
+
+    // sums up the counters of the triangles [begin, end) from all the blocks
+    void reduce(std::vector<int>& out_count, size_t begin, size_t end) const
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            out_count[i] = 0;
+        }
+        for (const auto& block : blocks)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                out_count[i] += block[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+
+// disjoint sets of triangles, joined by several threads at once without locks
+// a root is always attached to a smaller one, so the root of a set is its smallest index
+class ConcurrentDisjointSets
+{
+private:
+    std::vector<std::atomic<int>> parents;
+
+public:
+    void reset(size_t count)
+    {
+        parents = std::vector<std::atomic<int>>(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            parents[i].store(static_cast<int>(i), std::memory_order_relaxed);
+        }
+    }
+
+    // halves the path to the root on the way
+    int find(int i)
+    {
+        while (true)
+        {
+            int parent = parents[i].load(std::memory_order_relaxed);
+            if (parent == i)
+            {
+                return i;
+            }
+            const int grandparent = parents[parent].load(std::memory_order_relaxed);
+            if (grandparent != parent)
+            {
+                parents[i].compare_exchange_weak(parent, grandparent, std::memory_order_relaxed);
+            }
+            i = grandparent;
+        }
+    }
+
+    void unite(int i, int j)
+    {
+        while (true)
+        {
+            i = find(i);
+            j = find(j);
+            if (i == j)
+            {
+                return;
+            }
+            if (i < j)
+            {
+                std::swap(i, j);
+            }
+            int expected = i;
+            if (parents[i].compare_exchange_strong(expected, j, std::memory_order_relaxed))
+            {
+                return;
+            }
+        }
+    }
+
+    // true means the triangles are in the same set for sure, the sets only grow
+    bool areUnited(int i, int j)
+    {
+        return find(i) == find(j);
+    }
+};
+
+
+// picks the engine by a cheap look at the scene: sampled triangles are checked for box overlaps
+// with sampled other triangles, and their sizes are compared
+// the tiled brute force wins when a large share of the pairs overlaps anyway,
+// the hierarchy when the sizes of the triangles differ a lot, the uniform grid otherwise
+class EngineChooser
+{
+private:
+    static constexpr size_t samples_count = 256;
+    static constexpr size_t pairs_per_sample = 256;
+
+    // the share of the overlapping pairs above which nothing is saved by the broad phases
+    static constexpr float dense_overlap_share = 0.1f;
+
+    // the ratio of the large sizes to the median one above which a cell can't fit all the triangles
+    static constexpr float wide_size_spread = 30;
+
+    // size of the 95th percentile to the median size, 1 for the scenes of points
+    static float getSizeSpread(std::vector<float>& sizes)
+    {
+        const auto median = sizes.begin() + sizes.size() / 2;
+        const auto large = sizes.begin() + sizes.size() * 95 / 100;
+        std::nth_element(sizes.begin(), median, sizes.end());
+        const float median_size = *median;
+        std::nth_element(sizes.begin(), large, sizes.end());
+        if (*large <= 0)
+        {
+            return 1;
+        }
+        return median_size > 0 ? *large / median_size : std::numeric_limits<float>::infinity();
+    }
+
+    static float getSize(const BoundingBox& box)
+    {
+        return std::max(box.max_x - box.min_x, box.max_y - box.min_y);
+    }
+
+public:
+    static Task::Engine choose(const std::vector<Triangle>& triangles, Task::SceneEstimate& scene)
+    {
+        const size_t triangles_count = triangles.size();
+        scene = {};
+        if (triangles_count < 2)
+        {
+            return Task::Engine::TiledBruteForce;
+        }
+
+        // small scenes are looked at completely
+        const bool is_complete = triangles_count <= samples_count;
+        const size_t checked_count = is_complete ? triangles_count : samples_count;
+        uint64_t random = 0;
+        std::vector<float> sizes;
+        sizes.reserve(checked_count);
+        size_t pairs_count = 0;
+        size_t overlaps_count = 0;
+        for (size_t k = 0; k < checked_count; ++k)
+        {
+            const size_t i = is_complete ? k : getRandomIndex(random, triangles_count);
+            const auto box = BoundingBox::fromTriangle(triangles[i]);
+            sizes.push_back(getSize(box));
+            for (size_t n = 0; n < std::min(pairs_per_sample, triangles_count - 1); ++n)
+            {
+                // j != i, the others are taken in turn if there are few of them
+                size_t j = triangles_count - 1 <= pairs_per_sample ? n : getRandomIndex(random, triangles_count - 1);
+                j += j >= i ? 1 : 0;
+                overlaps_count += BoundingBox::areIntersected(box, BoundingBox::fromTriangle(triangles[j])) ? 1 : 0;
+                ++pairs_count;
+            }
+        }
+
+        const float overlap_share = static_cast<float>(overlaps_count) / static_cast<float>(pairs_count);
+        scene.overlap_degree = overlap_share * static_cast<float>(triangles_count - 1);
+        scene.size_spread = getSizeSpread(sizes);
+
+        if (overlap_share >= dense_overlap_share)
+        {
+            return Task::Engine::TiledBruteForce;
+        }
+        if (scene.size_spread >= wide_size_spread)
+        {
+            return Task::Engine::BoundingVolumeHierarchy;
+        }
+        return Task::Engine::UniformGrid;
+    }
+};
+
+// std::min takes it by reference, C++14 needs the definition then
+constexpr size_t EngineChooser::pairs_per_sample;
+
+
+// permutation of the triangles along the Morton curve (Z-order) of their centroids,
+// so the triangles close in space are close in memory too: the engines go from a triangle to its neighbours,
+// and their prepared triangles and counters are then in the same cache lines instead of all over the arrays
+// the codes are sorted by a parallel radix sort, all the stages are split between the threads
+class MortonOrder
+{
+public:
+    std::vector<Triangle> triangles; // the reordered copy
+    std::vector<int> order;          // order[k] is the original index of triangles[k]
+
+    explicit MortonOrder(size_t threads_count) :
+        threads_count(threads_count),
+        barrier(threads_count),
+        portions(threads_count)
+    {
+    }
+
+    // runOnThreads as in IntersectionsChecker::fillIntersectionsVector
+    template<class RunOnThreads>
+    void build(const std::vector<Triangle>& in_triangles, RunOnThreads&& runOnThreads)
+    {
+        source = &in_triangles;
+        triangles.resize(in_triangles.size());
+        order.resize(in_triangles.size());
+        entries.resize(in_triangles.size());
+        sorted_entries.resize(in_triangles.size());
+        runOnThreads([this](size_t thread)
+        {
+            buildPortion(thread);
+        });
+    }
+
+    // out_values[order[k]] = values[k]
+    void scatter(const std::vector<int>& values, std::vector<int>& out_values) const
+    {
+        out_values.resize(values.size());
+        for (size_t k = 0; k < values.size(); ++k)
+        {
+            out_values[order[k]] = values[k];
+        }
+    }
+
+    // the components by the smallest original index in them
+    void scatterComponents(const std::vector<int>& component, std::vector<int>& out_component) const
+    {
+        std::vector<int> smallest_index(component.size(), std::numeric_limits<int>::max());
+        for (size_t k = 0; k < component.size(); ++k)
+        {
+            smallest_index[component[k]] = std::min(smallest_index[component[k]], order[k]);
+        }
+        out_component.resize(component.size());
+        for (size_t k = 0; k < component.size(); ++k)
+        {
+            out_component[order[k]] = smallest_index[component[k]];
+        }
+    }
+
+    // the lists of the original triangles with the original indices, sorted again
+    template<class RunOnThreads>
+    void scatterAdjacency(const Task::Adjacency& adjacency, Task::Adjacency& out_adjacency,
+        RunOnThreads&& runOnThreads) const
+    {
+        const size_t triangles_count = order.size();
+        std::vector<int> position(triangles_count); // the inverse of order
+        for (size_t k = 0; k < triangles_count; ++k)
+        {
+            position[order[k]] = static_cast<int>(k);
+        }
+
+        auto& offsets = out_adjacency.offsets;
+        offsets.resize(triangles_count + 1);
+        offsets[0] = 0;
+        for (size_t i = 0; i < triangles_count; ++i)
+        {
+            const size_t k = position[i];
+            offsets[i + 1] = offsets[i] + (adjacency.offsets[k + 1] - adjacency.offsets[k]);
+        }
+        out_adjacency.neighbours.resize(offsets.back());
+
+        runOnThreads([&](size_t thread)
+        {
+            const size_t end = triangles_count * (thread + 1) / threads_count;
+            for (size_t i = triangles_count * thread / threads_count; i < end; ++i)
+            {
+                const size_t k = position[i];
+                auto list = out_adjacency.neighbours.begin() + offsets[i];
+                for (size_t n = adjacency.offsets[k]; n < adjacency.offsets[k + 1]; ++n)
+                {
+                    *list++ = order[adjacency.neighbours[n]];
+                }
+                std::sort(out_adjacency.neighbours.begin() + offsets[i], list);
+            }
+        });
+    }
+
+private:
+    // 16 bits per coordinate, sorted by 8 bits per pass
+    static constexpr int digit_bits = 8;
+    static constexpr size_t digits_count = size_t(1) << digit_bits;
+    static constexpr int code_bits = 32;
+
+    struct Entry
+    {
+        uint32_t code;
+        int index;
+    };
+
+    struct alignas(64) Portion
+    {
+        BoundingBox centroids_box;
+        size_t digits_counts[digits_count];
+    };
+
+    const size_t threads_count;
+    Barrier barrier;
+    std::vector<Portion> portions;
+    const std::vector<Triangle>* source = nullptr;
+    std::vector<Entry> entries;
+    std::vector<Entry> sorted_entries;
+
+    static Point getCentroid(const Triangle& tri)
+    {
+        return { (tri.a.x + tri.b.x + tri.c.x) / 3, (tri.a.y + tri.b.y + tri.c.y) / 3 };
+    }
+
+    // the bits of the value go to the even bits of the result
+    static uint32_t spreadBits(uint32_t value)
+    {
+        value = (value | (value << 8)) & 0x00ff00ff;
+        value = (value | (value << 4)) & 0x0f0f0f0f;
+        value = (value | (value << 2)) & 0x33333333;
+        value = (value | (value << 1)) & 0x55555555;
+        return value;
+    }
+
+    static uint32_t getCoordinateCode(float value, float min, float scale)
+    {
+        const float code = (value - min) * scale;
+        return code > 0 ? static_cast<uint32_t>(std::min(code, 65535.0f)) : 0;
+    }
+
+    void buildPortion(size_t thread)
+    {
+        const size_t count = source->size();
+        const size_t begin = count * thread / threads_count;
+        const size_t end = count * (thread + 1) / threads_count;
+
+        BoundingBox box = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+            std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest() };
+        for (size_t i = begin; i < end; ++i)
+        {
+            const auto centroid = getCentroid((*source)[i]);
+            box = BoundingBox::getUnion(box, { centroid.x, centroid.y, centroid.x, centroid.y });
+        }
+        portions[thread].centroids_box = box;
+        barrier.wait();
+
+        for (const auto& portion : portions)
+        {
+            box = BoundingBox::getUnion(box, portion.centroids_box);
+        }
+        const float size = std::max(box.max_x - box.min_x, box.max_y - box.min_y);
+        const float scale = size > 0 ? 65535 / size : 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            const auto centroid = getCentroid((*source)[i]);
+            entries[i] = {
+                    spreadBits(getCoordinateCode(centroid.x, box.min_x, scale)) |
+                        (spreadBits(getCoordinateCode(centroid.y, box.min_y, scale)) << 1),
+                    static_cast<int>(i)
+            };
+        }
+
+        // least significant digits first, every pass keeps the order of the equal digits,
+        // the entries of a thread go after the smaller digits of all the threads
+        // and after the same digit of the previous threads
+        for (int shift = 0; shift < code_bits; shift += digit_bits)
+        {
+            const auto& from = (shift / digit_bits) % 2 == 0 ? entries : sorted_entries;
+            auto& to = (shift / digit_bits) % 2 == 0 ? sorted_entries : entries;
+
+            auto& digits_counts = portions[thread].digits_counts;
+            std::fill(std::begin(digits_counts), std::end(digits_counts), 0);
+            for (size_t i = begin; i < end; ++i)
+            {
+                ++digits_counts[(from[i].code >> shift) & (digits_count - 1)];
+            }
+            barrier.wait();
+
+            size_t offsets[digits_count];
+            size_t offset = 0;
+            for (size_t digit = 0; digit < digits_count; ++digit)
+            {
+                offsets[digit] = offset;
+                for (size_t portion = 0; portion < threads_count; ++portion)
+                {
+                    offset += portions[portion].digits_counts[digit];
+                    if (portion < thread)
+                    {
+                        offsets[digit] += portions[portion].digits_counts[digit];
+                    }
+                }
+            }
+            for (size_t i = begin; i < end; ++i)
+            {
+                to[offsets[(from[i].code >> shift) & (digits_count - 1)]++] = from[i];
+            }
+            barrier.wait();
+        }
+
+        // an even number of passes, the result is in entries
+        for (size_t k = begin; k < end; ++k)
+        {
+            order[k] = entries[k].index;
+            triangles[k] = (*source)[entries[k].index];
+        }
+    }
+};
+
+
+// optional parts of a check, any of them may be null
+struct CheckExtras
+{
+    Task::Stats* stats = nullptr;
+    SweepCache* sweep_cache = nullptr;         // used by sweep and prune only
+    Task::Adjacency* out_adjacency = nullptr;  // the lists of the intersected triangles
+    std::vector<int>* out_component = nullptr; // the components of the graph of intersections
+    int max_count = 0;                         // the limit of the numbers of the intersections, 0 if there is none
+    bool is_exact = false;                     // the pairs are checked by the exact kernel
+    const GridMapping* grid_mapping = nullptr; // the pairs are checked on this grid
+};
+
+
+// everything a worker thread owns
+struct WorkerState
+{
+    IntersectionCounters::Block counters;
+    std::vector<int> candidates;
+    bool is_collecting_pairs = false;
+    std::vector<std::pair<int, int>> found_pairs; // intersected pairs, if is_collecting_pairs is set
+    std::vector<int8_t> previous_sides; // sides separating the triangle from the others in the previous call, by index
+    ConcurrentDisjointSets* components = nullptr; // set if the components are searched
+    int max_count = 0; // set if the numbers of the intersections are limited, the counters are shared then
+    std::atomic<size_t>* undecided_count = nullptr; // triangles having less than max_count intersections
+    double busy_time = 0;
+    Task::PairCheckStats pairs;
+
+    explicit WorkerState(const IntersectionCounters::Block& counters) : counters(counters)
+    {
+    }
+
+    void increment(int i, int value = 1)
+    {
+        const int count = counters.increment(i, value);
+        if (max_count > 0 && count >= max_count && count - value < max_count)
+        {
+            undecided_count->fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // true if every triangle already has max_count intersections, so nothing is left to check
+    bool isFinished() const
+    {
+        return max_count > 0 && undecided_count->load(std::memory_order_relaxed) == 0;
+    }
+
+    bool isSkippingPairs() const
+    {
+        return components != nullptr || max_count > 0;
+    }
+
+    // the pairs which can't change the result: the ones from the same component,
+    // or the ones of two triangles already having max_count intersections
+    bool canSkipPair(int i, int j)
+    {
+        if (components != nullptr)
+        {
+            return components->areUnited(i, j);
+        }
+        return max_count > 0 && counters.get(i) >= max_count && counters.get(j) >= max_count;
+    }
+};
+
+
+class IntersectionsChecker
+{
+private:
+    // the work is split into this many chunks per thread
+    static constexpr size_t chunks_per_thread = 64;
+
+    // number of triangles in a block of the tiled brute force,
+    // two blocks of prepared triangles (88 bytes per triangle) fit into L1 cache
+    static constexpr size_t tile_size = 128;
+
+    const std::vector<Triangle>& in_triangles;
+    std::vector<int>& out_count;
+    const size_t triangles_count;
+    Task::SceneEstimate scene; // filled if the engine is chosen automatically
+    const Task::Engine engine;
+    const size_t num_of_threads;
+    IntersectionCounters counters;
+    std::vector<BoundingBox> boxes;
+    PreparedTriangles prepared;
+    const PairKernel& kernel;
+    UniformGrid grid;
+    HierarchicalGrid hierarchical_grid;
+    std::vector<int> portions_cells_sizes;
+    bool is_counting_covered = false; // the triangles contained by the cells covered by a triangle are counted in bulk
+    std::vector<std::atomic<int>> covered_counts; // by the positions of the grid, see flushCoveredCounts
+    std::atomic<bool> has_covered{ false };
+    BoundingVolumeHierarchy hierarchy;
+    std::vector<BoundingVolumeHierarchy::Traversal> traversals;
+    ChunksCounter subtrees_chunks;
+    std::vector<SweepEntry> sweep_entries;
+    bool sweep_along_x = true;
+    Barrier barrier;
+    ChunksCounter chunks;
+    std::vector<size_t> tiles_rows_begin; // number of the first tile of every row, and the total number in the end
+    std::vector<double> threads_busy_time;
+    std::vector<Task::PairCheckStats> threads_pairs;
+    Task::Stats* stats;
+    SweepCache* sweep_cache;
+    Task::Adjacency* out_adjacency;
+    std::vector<int>* out_component;
+    ConcurrentDisjointSets components;
+    const int max_count;
+    const GridMapping* grid_mapping;
+    std::atomic<size_t> undecided_count{ 0 };
+    std::vector<std::atomic<size_t>> lists_fill; // where the next neighbour of every triangle goes
+    std::vector<size_t> portions_sizes;
+
+    // bit k of the mask means that the triangle i intersects the triangle getIndex(k)
+    // returns the number of intersections, to be added to the counter of i
+    template<class GetIndex>
+    static int markIntersectedByMask(WorkerState& state, int i, int mask, GetIndex&& getIndex)
+    {
+        int count = 0;
+        for (int lane = 0; mask != 0; ++lane, mask >>= 1)
+        {
+            if (mask & 1)
+            {
+                const int j = getIndex(lane);
+                state.increment(j);
+                if (state.is_collecting_pairs)
+                {
+                    state.found_pairs.push_back({ i, j });
+                }
+                if (state.components != nullptr)
+                {
+                    state.components->unite(i, j);
+                }
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    // checks the triangle i against all the candidates in state.candidates, several candidates at once
+    void checkCandidates(WorkerState& state, int i)
+    {
+        if (state.isSkippingPairs())
+        {
+            checkCandidatesSkippingPairs(state, i);
+            return;
+        }
+
+        const auto& candidates = state.candidates;
+        int count = 0;
+        for (size_t k = 0; k < candidates.size(); k += kernel.lanes_count)
+        {
+            const int* lanes = candidates.data() + k;
+            int mask = kernel.getCandidatesIntersectionMask(prepared, i, lanes,
+                std::min(kernel.lanes_count, candidates.size() - k), state.pairs);
+            count += markIntersectedByMask(state, i, mask, [lanes](int lane) { return lanes[lane]; });
+        }
+        state.increment(i, count);
+    }
+
+    // same as checkCandidates without the pairs which can be skipped,
+    // the candidates are filtered on the way, so the results of the checks are taken into account at once
+    void checkCandidatesSkippingPairs(WorkerState& state, int i)
+    {
+        if (state.isFinished())
+        {
+            return;
+        }
+
+        int lanes[PreparedTriangles::max_lanes_count];
+        size_t lanes_count = 0;
+        auto checkLanes = [&]
+        {
+            const int mask = kernel.getCandidatesIntersectionMask(prepared, i, lanes, lanes_count, state.pairs);
+            state.increment(i,
+                markIntersectedByMask(state, i, mask, [&lanes](int lane) { return lanes[lane]; }));
+            lanes_count = 0;
+        };
+
+        for (int j : state.candidates)
+        {
+            if (!state.canSkipPair(i, j))
+            {
+                lanes[lanes_count++] = j;
+                if (lanes_count == kernel.lanes_count)
+                {
+                    checkLanes();
+                }
+            }
+        }
+        if (lanes_count > 0)
+        {
+            checkLanes();
+        }
+    }
+
+    // lanes of the pairs of i with the triangles [first, first + count) which can be skipped
+    static int getSkippedMask(WorkerState& state, size_t i, size_t first, size_t count)
+    {
+        if (!state.isSkippingPairs())
+        {
+            return 0;
+        }
+        int mask = 0;
+        for (size_t lane = 0; lane < count; ++lane)
+        {
+            if (state.canSkipPair(static_cast<int>(i), static_cast<int>(first + lane)))
+            {
+                mask |= 1 << lane;
+            }
+        }
+        return mask;
+    }
+
+    // the work ends early once every triangle has max_count intersections
+    bool getNextChunk(const WorkerState& state, size_t& begin, size_t& end)
+    {
+        return !state.isFinished() && chunks.getNextChunk(begin, end);
+    }
+
+    static size_t getPortionBegin(size_t count, size_t num_of_portions, size_t current_portion)
+    {
+        return count / num_of_portions * current_portion;
+    }
+
+    static size_t getPortionEnd(size_t count, size_t num_of_portions, size_t current_portion)
+    {
+        return num_of_portions == current_portion + 1 ?
+            count :
+            count / num_of_portions * (current_portion + 1);
+    }
+
+    void checkPortionOfTriangles(int num_of_portions, int current_portion)
+    {
+        const auto portion_begin = getPortionBegin(triangles_count, num_of_portions, current_portion);
+        const auto portion_end = getPortionEnd(triangles_count, num_of_portions, current_portion);
+        WorkerState state(counters.getBlock(current_portion));
+        state.is_collecting_pairs = out_adjacency != nullptr;
+        state.components = out_component != nullptr ? &components : nullptr;
+        state.max_count = max_count;
+        state.undecided_count = &undecided_count;
+        {
+            BusyTimer timer(state.busy_time);
+            if (grid_mapping != nullptr)
+            {
+                prepared.prepareOnGrid(in_triangles, portion_begin, portion_end, *grid_mapping);
+            }
+            else
+            {
+                prepared.prepare(in_triangles, portion_begin, portion_end);
+            }
+        }
+        barrier.wait();
+
+        switch (engine)
+        {
+        case Task::Engine::BruteForce:
+            checkAllPairs(state);
+            break;
+        case Task::Engine::TiledBruteForce:
+            checkAllPairsByTiles(state);
+            break;
+        case Task::Engine::UniformGrid:
+            checkCandidatesFromGrid(state, num_of_portions, current_portion);
+            break;
+        case Task::Engine::SweepAndPrune:
+            sweepAndPrune(state, num_of_portions, current_portion);
+            break;
+        case Task::Engine::BoundingVolumeHierarchy:
+            checkCandidatesFromHierarchy(state);
+            break;
+        case Task::Engine::HierarchicalGrid:
+            checkCandidatesFromHierarchicalGrid(state, num_of_portions, current_portion);
+            break;
+        case Task::Engine::Automatic: // replaced by the chosen engine in the constructor
+            break;
+        }
+
+        barrier.wait();
+        {
+            BusyTimer timer(state.busy_time);
+            counters.reduce(out_count, portion_begin, portion_end);
+            if (max_count > 0)
+            {
+                for (size_t i = portion_begin; i < portion_end; ++i)
+                {
+                    out_count[i] = std::min(out_count[i], max_count);
+                }
+            }
+        }
+
+        if (out_adjacency != nullptr)
+        {
+            fillAdjacency(state, num_of_portions, current_portion);
+        }
+
+        if (out_component != nullptr)
+        {
+            barrier.wait();
+            BusyTimer timer(state.busy_time);
+            for (size_t i = portion_begin; i < portion_end; ++i)
+            {
+                (*out_component)[i] = components.find(static_cast<int>(i));
+            }
+        }
+
+        threads_busy_time[current_portion] = state.busy_time;
+        threads_pairs[current_portion] = state.pairs;
+    }
+
+    // the lists go one after another in the order of the triangles, the sizes of the lists are the counters
+    // every thread places the lists of its portion of the triangles, then puts the pairs it found into them
+    void fillAdjacency(WorkerState& state, size_t num_of_portions, size_t current_portion)
+    {
+        const auto portion_begin = getPortionBegin(triangles_count, num_of_portions, current_portion);
+        const auto portion_end = getPortionEnd(triangles_count, num_of_portions, current_portion);
+        auto& offsets = out_adjacency->offsets;
+        auto& neighbours = out_adjacency->neighbours;
+
+        barrier.wait();
+        {
+            BusyTimer timer(state.busy_time);
+            size_t size = 0;
+            for (size_t i = portion_begin; i < portion_end; ++i)
+            {
+                size += out_count[i];
+            }
+            portions_sizes[current_portion] = size;
+        }
+        barrier.wait();
+        {
+            BusyTimer timer(state.busy_time);
+            size_t offset = 0;
+            for (size_t portion = 0; portion < current_portion; ++portion)
+            {
+                offset += portions_sizes[portion];
+            }
+            for (size_t i = portion_begin; i < portion_end; ++i)
+            {
+                offsets[i] = offset;
+                lists_fill[i].store(offset, std::memory_order_relaxed);
+                offset += out_count[i];
+            }
+            if (current_portion + 1 == num_of_portions)
+            {
+                offsets[triangles_count] = offset;
+                neighbours.resize(offset);
+            }
+        }
+        barrier.wait();
+        {
+            BusyTimer timer(state.busy_time);
+            for (const auto& pair : state.found_pairs)
+            {
+                neighbours[lists_fill[pair.first].fetch_add(1, std::memory_order_relaxed)] = pair.second;
+                neighbours[lists_fill[pair.second].fetch_add(1, std::memory_order_relaxed)] = pair.first;
+            }
+        }
+        barrier.wait();
+        {
+            BusyTimer timer(state.busy_time);
+            for (size_t i = portion_begin; i < portion_end; ++i)
+            {
+                std::sort(neighbours.begin() + offsets[i], neighbours.begin() + offsets[i + 1]);
+            }
+        }
+    }
+
+    // the chunks are handed out in the order of i, so the heaviest ones (small i) go first
+    // and the last chunks are light enough to even out the finish of the threads
+    void checkAllPairs(WorkerState& state)
+    {
+        size_t chunk_begin, chunk_end;
+        while (getNextChunk(state, chunk_begin, chunk_end))
+        {
+            BusyTimer timer(state.busy_time);
+            for (size_t i = chunk_begin; i < chunk_end; ++i)
+            {
+                int count = 0;
+                for (size_t j = i + 1; j < triangles_count; j += kernel.lanes_count)
+                {
+                    const size_t lanes_count = std::min(kernel.lanes_count, triangles_count - j);
+                    const int skipped_mask = getSkippedMask(state, i, j, lanes_count);
+                    if (skipped_mask == getLanesMask(lanes_count))
+                    {
+                        continue;
+                    }
+                    int mask = kernel.getRangeIntersectionMask(prepared, i, j, lanes_count, state.pairs) &
+                        ~skipped_mask;
+                    count += markIntersectedByMask(state, static_cast<int>(i), mask,
+                        [j](int lane) { return static_cast<int>(j) + lane; });
+
+                    // the limited counters are shared, the sooner i gets its count, the more pairs are skipped
+                    if (max_count > 0)
+                    {
+                        state.increment(static_cast<int>(i), count);
+                        count = 0;
+                    }
+                }
+                state.increment(static_cast<int>(i), count);
+            }
+        }
+    }
+
+    // tile (I, J), J >= I, contains the pairs (i, j) with i from the block I and j from the block J
+    // the blocks of prepared triangles of a tile stay in L1 cache while its pairs are checked,
+    // and the counters of both blocks are accumulated on the stack
+    // tiles are numbered row by row, so the consecutive ones share the block I
+    void checkAllPairsByTiles(WorkerState& state)
+    {
+        size_t chunk_begin, chunk_end;
+        while (getNextChunk(state, chunk_begin, chunk_end))
+        {
+            BusyTimer timer(state.busy_time);
+
+            size_t block_i = std::upper_bound(tiles_rows_begin.begin(), tiles_rows_begin.end(), chunk_begin) -
+                tiles_rows_begin.begin() - 1;
+            size_t block_j = block_i + (chunk_begin - tiles_rows_begin[block_i]);
+            for (size_t tile = chunk_begin; tile < chunk_end; ++tile)
+            {
+                checkTile(state, block_i, block_j);
+                if (++block_j == tiles_rows_begin.size() - 1)
+                {
+                    ++block_i;
+                    block_j = block_i;
+                }
+            }
+        }
+    }
+
+    void checkTile(WorkerState& state, size_t block_i, size_t block_j)
+    {
+        int counts_i[tile_size] = {};
+        int counts_j[tile_size] = {};
+
+        const size_t begin_i = block_i * tile_size;
+        const size_t end_i = std::min(begin_i + tile_size, triangles_count);
+        const size_t begin_j = block_j * tile_size;
+        const size_t end_j = std::min(begin_j + tile_size, triangles_count);
+
+        for (size_t i = begin_i; i < end_i; ++i)
+        {
+            const size_t first_j = block_i == block_j ? i + 1 : begin_j;
+            for (size_t j = first_j; j < end_j; j += kernel.lanes_count)
+            {
+                const size_t lanes_count = std::min(kernel.lanes_count, end_j - j);
+                const int skipped_mask = getSkippedMask(state, i, j, lanes_count);
+                if (skipped_mask == getLanesMask(lanes_count))
+                {
+                    continue;
+                }
+                int mask = kernel.getRangeIntersectionMask(prepared, i, j, lanes_count, state.pairs) & ~skipped_mask;
+                for (size_t lane = j - begin_j; mask != 0; ++lane, mask >>= 1)
+                {
+                    if (mask & 1)
+                    {
+                        ++counts_i[i - begin_i];
+                        ++counts_j[lane];
+                        if (state.is_collecting_pairs)
+                        {
+                            state.found_pairs.push_back({ static_cast<int>(i), static_cast<int>(begin_j + lane) });
+                        }
+                        if (state.components != nullptr)
+                        {
+                            state.components->unite(static_cast<int>(i), static_cast<int>(begin_j + lane));
+                        }
+                    }
+                }
+            }
+        }
+
+        for (size_t i = begin_i; i < end_i; ++i)
+        {
+            state.increment(static_cast<int>(i), counts_i[i - begin_i]);
+        }
+        for (size_t j = begin_j; j < end_j; ++j)
+        {
+            state.increment(static_cast<int>(j), counts_j[j - begin_j]);
+        }
+    }
+
+    void checkCandidatesFromGrid(WorkerState& state, size_t num_of_portions, size_t current_portion)
+    {
+        size_t chunk_begin, chunk_end;
+        while (getNextChunk(state, chunk_begin, chunk_end))
+        {
+            BusyTimer timer(state.busy_time);
+            for (size_t i = chunk_begin; i < chunk_end; ++i)
+            {
+                state.candidates.clear();
+                if (is_counting_covered)
+                {
+                    grid.forEachCandidate(static_cast<int>(i), in_triangles[i], boxes,
+                        [&](int j) { state.candidates.push_back(j); },
+                        [&](size_t begin, size_t end) { countCovered(state, static_cast<int>(i), begin, end); });
+                }
+                else
+                {
+                    grid.forEachCandidate(static_cast<int>(i), boxes, [&](int j) { state.candidates.push_back(j); });
+                }
+                checkCandidates(state, static_cast<int>(i));
+            }
+        }
+
+        if (is_counting_covered)
+        {
+            barrier.wait();
+            if (has_covered.load(std::memory_order_relaxed))
+            {
+                BusyTimer timer(state.busy_time);
+                flushCoveredCounts(state, num_of_portions, current_portion);
+            }
+        }
+    }
+
+    // the triangle i covers the cell, and intersects the triangles at the positions [begin, end) contained by it
+    // i gets them all at once, and they get theirs from the covered counts after all the triangles are checked:
+    // the count at a position is added to the triangles at it and after it in its cell
+    void countCovered(WorkerState& state, int i, size_t begin, size_t end)
+    {
+        state.increment(i, static_cast<int>(end - begin));
+        state.pairs.counted_by_covered_cells += end - begin;
+        covered_counts[begin].fetch_add(1, std::memory_order_relaxed);
+        has_covered.store(true, std::memory_order_relaxed);
+    }
+
+    void flushCoveredCounts(WorkerState& state, size_t num_of_portions, size_t current_portion)
+    {
+        const int cells_count = grid.getCellsCount();
+        const auto cells_begin = getPortionBegin(cells_count, num_of_portions, current_portion);
+        const auto cells_end = getPortionEnd(cells_count, num_of_portions, current_portion);
+        for (size_t cell = cells_begin; cell < cells_end; ++cell)
+        {
+            int count = 0;
+            for (size_t position = grid.getContainedBegin(static_cast<int>(cell));
+                position < grid.getContainedEnd(static_cast<int>(cell)); ++position)
+            {
+                count += covered_counts[position].load(std::memory_order_relaxed);
+                if (count > 0)
+                {
+                    state.increment(grid.getItem(position), count);
+                }
+            }
+        }
+    }
+
+    // every thread inserts its portion of the triangles into the grid, the cells are placed in parallel too
+    // after that the threads check the triangles chunk by chunk
+    void checkCandidatesFromHierarchicalGrid(WorkerState& state, size_t num_of_portions, size_t current_portion)
+    {
+        const auto portion_begin = getPortionBegin(triangles_count, num_of_portions, current_portion);
+        const auto portion_end = getPortionEnd(triangles_count, num_of_portions, current_portion);
+        const auto cells_count = hierarchical_grid.getCellsCount();
+        const auto cells_begin = getPortionBegin(cells_count, num_of_portions, current_portion);
+        const auto cells_end = getPortionEnd(cells_count, num_of_portions, current_portion);
+
+        {
+            BusyTimer timer(state.busy_time);
+            hierarchical_grid.count(boxes, portion_begin, portion_end);
+        }
+        barrier.wait();
+        {
+            BusyTimer timer(state.busy_time);
+            portions_cells_sizes[current_portion] = hierarchical_grid.getCellsSize(cells_begin, cells_end);
+        }
+        barrier.wait();
+        {
+            BusyTimer timer(state.busy_time);
+            int items_begin = 0;
+            for (size_t portion = 0; portion < current_portion; ++portion)
+            {
+                items_begin += portions_cells_sizes[portion];
+            }
+            hierarchical_grid.placeCells(cells_begin, cells_end, items_begin);
+        }
+        barrier.wait();
+        {
+            BusyTimer timer(state.busy_time);
+            hierarchical_grid.fill(portion_begin, portion_end);
+        }
+        barrier.wait();
+
+        size_t chunk_begin, chunk_end;
+        while (getNextChunk(state, chunk_begin, chunk_end))
+        {
+            BusyTimer timer(state.busy_time);
+            for (size_t i = chunk_begin; i < chunk_end; ++i)
+            {
+                state.candidates.clear();
+                hierarchical_grid.forEachCandidate(static_cast<int>(i), boxes,
+                    [&](int j) { state.candidates.push_back(j); });
+                checkCandidates(state, static_cast<int>(i));
+            }
+        }
+    }
+
+    // the threads build the subtrees of the hierarchy, then traverse it in independent parts
+    void checkCandidatesFromHierarchy(WorkerState& state)
+    {
+        size_t chunk_begin, chunk_end;
+        while (subtrees_chunks.getNextChunk(chunk_begin, chunk_end))
+        {
+            BusyTimer timer(state.busy_time);
+            for (size_t subtree = chunk_begin; subtree < chunk_end; ++subtree)
+            {
+                hierarchy.buildSubtree(subtree, boxes);
+            }
+        }
+        barrier.wait();
+
+        std::vector<BoundingVolumeHierarchy::Traversal> stack;
+        std::vector<int> items_stack;
+        while (getNextChunk(state, chunk_begin, chunk_end))
+        {
+            BusyTimer timer(state.busy_time);
+            for (size_t k = chunk_begin; k < chunk_end; ++k)
+            {
+                hierarchy.traverse(traversals[k], state.candidates, stack, items_stack,
+                    [&](int i) { checkCandidates(state, i); });
+            }
+        }
+    }
+
+    // same as checkCandidates, but the pairs separated by a side in the previous call are checked by that side first
+    // the separated pairs go to the cache with their sides
+    void checkCandidatesWithCache(WorkerState& state, size_t thread, int i)
+    {
+        auto& cache = *sweep_cache;
+        const auto& previous_range = cache.triangles_pairs[cache.current ^ 1][i];
+        const auto* previous_pairs = cache.threads_pairs[cache.current ^ 1][previous_range.thread].data() +
+            previous_range.first;
+        auto& pairs = cache.threads_pairs[cache.current][thread];
+        const size_t first_pair = pairs.size();
+
+        // the previous sides are spread by the indices of the triangles, to be found at once
+        auto& previous_sides = state.previous_sides;
+        for (size_t k = 0; k < previous_range.count; ++k)
+        {
+            previous_sides[previous_pairs[k].index] = static_cast<int8_t>(previous_pairs[k].side);
+        }
+
+        // the candidates still to be checked stay at the beginning
+        auto& candidates = state.candidates;
+        size_t checked_count = 0;
+        for (int j : candidates)
+        {
+            const int side = previous_sides[j];
+            if (side != SweepCache::no_side && prepared.isSeparatedBySide(i, j, side))
+            {
+                pairs.push_back({ j, side });
+                ++state.pairs.skipped_by_cached_side;
+            }
+            else
+            {
+                candidates[checked_count++] = j;
+            }
+        }
+
+        for (size_t k = 0; k < previous_range.count; ++k)
+        {
+            previous_sides[previous_pairs[k].index] = SweepCache::no_side;
+        }
+
+        int count = 0;
+        for (size_t k = 0; k < checked_count; k += kernel.lanes_count)
+        {
+            const int* lanes = candidates.data() + k;
+            const size_t lanes_count = std::min(kernel.lanes_count, checked_count - k);
+            const int mask = kernel.getCandidatesIntersectionMask(prepared, i, lanes, lanes_count, state.pairs);
+            count += markIntersectedByMask(state, i, mask, [lanes](int lane) { return lanes[lane]; });
+
+            int separated_mask = ~mask & getLanesMask(lanes_count);
+            for (int lane = 0; separated_mask != 0; ++lane, separated_mask >>= 1)
+            {
+                if (separated_mask & 1)
+                {
+                    pairs.push_back({ lanes[lane], prepared.findSeparatingSide(i, lanes[lane]) });
+                }
+            }
+        }
+        state.increment(i, count);
+
+        cache.triangles_pairs[cache.current][i] =
+            { first_pair, static_cast<uint32_t>(thread), static_cast<uint32_t>(pairs.size() - first_pair) };
+    }
+
+    // every thread sorts its portion of the intervals, then the sorted portions are merged pairwise
+    // after that the threads sweep the sorted intervals chunk by chunk
+    // with the sweep cache the intervals are already sorted
+    void sweepAndPrune(WorkerState& state, size_t num_of_portions, size_t current_portion)
+    {
+        auto portion_begin = getPortionBegin(triangles_count, num_of_portions, current_portion);
+        auto portion_end = getPortionEnd(triangles_count, num_of_portions, current_portion);
+
+        if (sweep_cache != nullptr)
+        {
+            sweep_cache->threads_pairs[sweep_cache->current][current_portion].clear();
+            state.previous_sides.assign(triangles_count, SweepCache::no_side);
+            num_of_portions = 1;
+        }
+        else
+        {
+            BusyTimer timer(state.busy_time);
+            for (size_t i = portion_begin; i < portion_end; ++i)
+            {
+                const auto& box = boxes[i];
+                sweep_entries[i] = sweep_along_x ?
+                    SweepEntry{ box.min_x, box.max_x, static_cast<int>(i) } :
+                    SweepEntry{ box.min_y, box.max_y, static_cast<int>(i) };
+            }
+            std::sort(sweep_entries.begin() + portion_begin, sweep_entries.begin() + portion_end,
+                SweepEntry::isLess);
+        }
+
+        for (size_t step = 1; step < num_of_portions; step *= 2)
+        {
+            barrier.wait();
+            if (current_portion % (2 * step) == 0 && current_portion + step < num_of_portions)
+            {
+                BusyTimer timer(state.busy_time);
+                auto last_portion = std::min(current_portion + 2 * step, num_of_portions) - 1;
+                std::inplace_merge(
+                    sweep_entries.begin() + portion_begin,
+                    sweep_entries.begin() + getPortionBegin(triangles_count, num_of_portions, current_portion + step),
+                    sweep_entries.begin() + getPortionEnd(triangles_count, num_of_portions, last_portion),
+                    SweepEntry::isLess);
+            }
+        }
+        barrier.wait();
+
+        size_t chunk_begin, chunk_end;
+        while (getNextChunk(state, chunk_begin, chunk_end))
+        {
+            BusyTimer timer(state.busy_time);
+            for (size_t p = chunk_begin; p < chunk_end; ++p)
+            {
+                const auto& entry = sweep_entries[p];
+                const auto i = entry.index;
+                state.candidates.clear();
+                for (size_t q = p + 1; q < triangles_count && sweep_entries[q].begin <= entry.end; ++q)
+                {
+                    const auto j = sweep_entries[q].index;
+                    if (BoundingBox::areIntersected(boxes[i], boxes[j]))
+                    {
+                        state.candidates.push_back(j);
+                    }
+                }
+                if (sweep_cache != nullptr)
+                {
+                    checkCandidatesWithCache(state, current_portion, i);
+                }
+                else
+                {
+                    checkCandidates(state, i);
+                }
+            }
+        }
+    }
+
+    // takes the intervals sorted by the previous call and sorts them again with the new boxes,
+    // starts from scratch if the previous call had other triangles
+    void prepareSweepCache()
+    {
+        // every thread clears its pairs whatever the number of the triangles, so they are sized by the threads
+        auto& cache = *sweep_cache;
+        if (cache.triangles_count != triangles_count || cache.threads_count != num_of_threads ||
+            cache.threads_pairs[cache.current].size() != num_of_threads)
+        {
+            cache.triangles_count = triangles_count;
+            cache.threads_count = num_of_threads;
+            cache.sweep_along_x = isSweepAlongX();
+            cache.sweep_entries.resize(triangles_count);
+            for (size_t i = 0; i < triangles_count; ++i)
+            {
+                cache.sweep_entries[i].index = static_cast<int>(i);
+            }
+            for (int k = 0; k < 2; ++k)
+            {
+                cache.threads_pairs[k].assign(num_of_threads, {});
+                cache.triangles_pairs[k].assign(triangles_count, { 0, 0, 0 });
+            }
+        }
+
+        for (auto& entry : cache.sweep_entries)
+        {
+            const auto& box = boxes[entry.index];
+            entry.begin = cache.sweep_along_x ? box.min_x : box.min_y;
+            entry.end = cache.sweep_along_x ? box.max_x : box.max_y;
+        }
+        SweepCache::sort(cache.sweep_entries);
+
+        sweep_along_x = cache.sweep_along_x;
+        sweep_entries.swap(cache.sweep_entries);
+        cache.current ^= 1;
+    }
+
+    // sweep along the axis where the centers of the triangles are spread wider
+    bool isSweepAlongX() const
+    {
+        double sum_x = 0, sum_y = 0, sum_x2 = 0, sum_y2 = 0;
+        for (const auto& box : boxes)
+        {
+            double x = 0.5 * (static_cast<double>(box.min_x) + box.max_x);
+            double y = 0.5 * (static_cast<double>(box.min_y) + box.max_y);
+            sum_x += x;
+            sum_y += y;
+            sum_x2 += x * x;
+            sum_y2 += y * y;
+        }
+        return sum_x2 - sum_x * sum_x / triangles_count >= sum_y2 - sum_y * sum_y / triangles_count;
+    }
+
+    void fillStats()
+    {
+        if (stats != nullptr)
+        {
+            stats->threads_busy_time = threads_busy_time;
+            stats->engine = engine;
+            stats->scene = scene;
+            stats->pairs = {};
+            for (const auto& pairs : threads_pairs)
+            {
+                stats->pairs.checked += pairs.checked;
+                stats->pairs.rejected_by_bounding_boxes += pairs.rejected_by_bounding_boxes;
+                stats->pairs.rejected_by_first_triangle += pairs.rejected_by_first_triangle;
+                stats->pairs.rejected_by_second_triangle += pairs.rejected_by_second_triangle;
+                stats->pairs.skipped_by_cached_side += pairs.skipped_by_cached_side;
+                stats->pairs.counted_by_covered_cells += pairs.counted_by_covered_cells;
+            }
+        }
+    }
+
+    static const PairKernel& getKernel(const CheckExtras& extras)
+    {
+        if (extras.grid_mapping != nullptr)
+        {
+            return PairKernel::getOnGrid(extras.grid_mapping->isNarrow());
+        }
+        return extras.is_exact ? PairKernel::getExact() : PairKernel::get();
+    }
+
+public:
+    // with extras.out_component the pairs from the same component are not checked,
+    // so out_count gets only the numbers of the intersections found on the way
+    IntersectionsChecker(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+        Task::Engine engine, const CheckExtras& extras = {},
+        size_t num_of_threads = std::max(std::thread::hardware_concurrency(), 1u)) :
+        in_triangles(in_triangles),
+        out_count(out_count),
+        triangles_count(in_triangles.size()),
+        engine(engine == Task::Engine::Automatic ? EngineChooser::choose(in_triangles, scene) : engine),
+        num_of_threads(num_of_threads),
+        counters(triangles_count, num_of_threads, extras.max_count > 0),
+        kernel(getKernel(extras)),
+        barrier(num_of_threads),
+        threads_busy_time(num_of_threads),
+        threads_pairs(num_of_threads),
+        stats(extras.stats),
+        sweep_cache(engine == Task::Engine::SweepAndPrune ? extras.sweep_cache : nullptr),
+        out_adjacency(extras.out_adjacency),
+        out_component(extras.out_component),
+        max_count(extras.max_count),
+        grid_mapping(extras.grid_mapping)
+    {
+    }
+
+    // runOnThreads(task) must call task(0), ..., task(num_of_threads - 1) simultaneously on different threads
+    // and return when all of them finish
+    template<class RunOnThreads>
+    void fillIntersectionsVector(RunOnThreads&& runOnThreads)
+    {
+        // nothing to check, and the portions below expect at least one triangle
+        if (triangles_count == 0)
+        {
+            out_count.clear();
+            if (out_adjacency != nullptr)
+            {
+                out_adjacency->offsets.assign(1, 0);
+                out_adjacency->neighbours.clear();
+            }
+            if (out_component != nullptr)
+            {
+                out_component->clear();
+            }
+            if (sweep_cache != nullptr)
+            {
+                sweep_cache->triangles_count = 0; // the number changed, the next call starts from scratch
+            }
+            fillStats();
+            return;
+        }
+
+        boxes.reserve(triangles_count);
+        for (const auto& tri : in_triangles)
+        {
+            boxes.push_back(BoundingBox::fromTriangle(tri));
+        }
+        if (grid_mapping != nullptr)
+        {
+            prepared.resizeOnGrid(triangles_count);
+        }
+        else
+        {
+            prepared.resize(triangles_count);
+        }
+
+        if (engine == Task::Engine::UniformGrid && triangles_count > 0)
+        {
+            grid.build(boxes);
+
+            // the bulk counts give no pairs, and the skipped pairs can't be told apart in them
+            is_counting_covered = out_adjacency == nullptr && out_component == nullptr && max_count == 0 &&
+                grid.hasCoveringTriangles();
+            if (is_counting_covered)
+            {
+                covered_counts = std::vector<std::atomic<int>>(grid.getItemsCount());
+            }
+        }
+
+        if (engine == Task::Engine::SweepAndPrune && triangles_count > 0)
+        {
+            if (sweep_cache != nullptr)
+            {
+                prepareSweepCache();
+            }
+            else
+            {
+                sweep_along_x = isSweepAlongX();
+                sweep_entries.resize(triangles_count);
+            }
+        }
+
+        if (engine == Task::Engine::HierarchicalGrid && triangles_count > 0)
+        {
+            hierarchical_grid.prepare(boxes);
+            portions_cells_sizes.resize(num_of_threads);
+        }
+
+        // brute force and grid don't check the last triangle, it has no pairs with greater indices
+        // (the last triangle of the hierarchical grid still has pairs on the coarser levels)
+        size_t chunked_count = engine == Task::Engine::SweepAndPrune || engine == Task::Engine::HierarchicalGrid ?
+            triangles_count :
+            triangles_count - std::min<size_t>(triangles_count, 1);
+
+        // the subtrees are small enough to give every thread several of them
+        if (engine == Task::Engine::BoundingVolumeHierarchy && triangles_count > 0)
+        {
+            hierarchy.buildTop(boxes, std::max<size_t>(1024, triangles_count / (num_of_threads * chunks_per_thread)));
+            traversals = hierarchy.getTraversals(num_of_threads * chunks_per_thread);
+            chunked_count = traversals.size();
+        }
+        subtrees_chunks.reset(hierarchy.getSubtreesCount(), hierarchy.getSubtreesCount());
+
+        if (engine == Task::Engine::TiledBruteForce)
+        {
+            const size_t blocks_count = (triangles_count + tile_size - 1) / tile_size;
+            tiles_rows_begin.resize(blocks_count + 1);
+            tiles_rows_begin[0] = 0;
+            for (size_t block = 0; block < blocks_count; ++block)
+            {
+                tiles_rows_begin[block + 1] = tiles_rows_begin[block] + (blocks_count - block);
+            }
+            chunked_count = tiles_rows_begin.back();
+        }
+        chunks.reset(chunked_count, num_of_threads * chunks_per_thread);
+
+        // the threads write the sums of the counters straight into out_count
+        out_count.resize(triangles_count);
+
+        undecided_count = triangles_count;
+
+        if (out_component != nullptr)
+        {
+            out_component->resize(triangles_count);
+            components.reset(triangles_count);
+        }
+
+        if (out_adjacency != nullptr)
+        {
+            out_adjacency->offsets.resize(triangles_count + 1);
+            out_adjacency->offsets[0] = 0;
+            out_adjacency->neighbours.clear();
+            lists_fill = std::vector<std::atomic<size_t>>(triangles_count);
+            portions_sizes.resize(num_of_threads);
+        }
+
+        runOnThreads([this](size_t current_portion)
+        {
+            checkPortionOfTriangles(num_of_threads, current_portion);
+        });
+
+        if (sweep_cache != nullptr)
+        {
+            sweep_entries.swap(sweep_cache->sweep_entries);
+        }
+
+        fillStats();
+    }
+
+    // creates the threads for this call only
+    void fillIntersectionsVector()
+    {
+        fillIntersectionsVector([this](const std::function<void(size_t)>& task)
+        {
+            std::vector<std::thread> threads;
+
+            threads.reserve(num_of_threads);
+            for (size_t i = 0; i < num_of_threads; ++i)
+            {
+                threads.emplace_back(task, i);
+            }
+
+            for (auto& t : threads)
+            {
+                t.join();
+            }
+        });
+    }
+};
+
+
+// IntersectionsChecker on the triangles in the Morton order, the results are put back in the original order
+// (it makes the engines 1.3-3 times faster on the triangles given in a random order)
+// small scenes are checked as they are, their prepared triangles fit into L2 cache anyway,
+// and so are the checks with a sweep cache, which keeps the indices of the triangles from call to call
+class MortonOrderedChecker
+{
+public:
+    static constexpr size_t min_reordered_count = 4096;
+
+    MortonOrderedChecker(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+        Task::Engine engine, const CheckExtras& extras = {},
+        size_t num_of_threads = std::max(std::thread::hardware_concurrency(), 1u)) :
+        in_triangles(in_triangles),
+        out_count(out_count),
+        engine(engine),
+        extras(extras),
+        num_of_threads(num_of_threads)
+    {
+    }
+
+    template<class RunOnThreads>
+    void fillIntersectionsVector(RunOnThreads&& runOnThreads)
+    {
+        if (in_triangles.size() < min_reordered_count || extras.sweep_cache != nullptr)
+        {
+            IntersectionsChecker checker(in_triangles, out_count, engine, extras, num_of_threads);
+            checker.fillIntersectionsVector(runOnThreads);
+            return;
+        }
+
+        MortonOrder morton_order(num_of_threads);
+        morton_order.build(in_triangles, runOnThreads);
+
+        // the results in the Morton order
+        std::vector<int> count;
+        Task::Adjacency adjacency;
+        std::vector<int> component;
+        CheckExtras ordered_extras = extras;
+        ordered_extras.out_adjacency = extras.out_adjacency != nullptr ? &adjacency : nullptr;
+        ordered_extras.out_component = extras.out_component != nullptr ? &component : nullptr;
+        {
+            IntersectionsChecker checker(morton_order.triangles, count, engine, ordered_extras, num_of_threads);
+            checker.fillIntersectionsVector(runOnThreads);
+        }
+
+        morton_order.scatter(count, out_count);
+        if (extras.out_adjacency != nullptr)
+        {
+            morton_order.scatterAdjacency(adjacency, *extras.out_adjacency, runOnThreads);
+        }
+        if (extras.out_component != nullptr)
+        {
+            morton_order.scatterComponents(component, *extras.out_component);
+        }
+    }
+
+    // creates the threads for this call only
+    void fillIntersectionsVector()
+    {
+        fillIntersectionsVector([this](const std::function<void(size_t)>& task)
+        {
+            std::vector<std::thread> threads;
+
+            threads.reserve(num_of_threads);
+            for (size_t i = 0; i < num_of_threads; ++i)
+            {
+                threads.emplace_back(task, i);
+            }
+
+            for (auto& t : threads)
+            {
+                t.join();
+            }
+        });
+    }
+
+private:
+    const std::vector<Triangle>& in_triangles;
+    std::vector<int>& out_count;
+    const Task::Engine engine;
+    const CheckExtras extras;
+    const size_t num_of_threads;
+};
+
+
+// estimates the numbers of the intersections by stratified sampling of the candidates from the uniform grid
+// the strata of the triangle i are the cells covered by its box, with all the triangles stored in them,
+// and the samples are spread over the cells in proportion to their sizes
+// a sampled triangle j counts only if it intersects i and the pair is reported from the cell of the sample,
+// so the counts of all the cells sum up to the exact number of the intersections
+// the triangles with no more candidates than samples are checked exactly
+class IntersectionsEstimator
+{
+private:
+    static constexpr size_t chunks_per_thread = 64;
+
+    // a sample costs about as much as 3 pairs checked by the uniform grid, and the grid checks every pair once,
+    // from one of the 2 triangles, so the samples take less time only if there are more candidates than that
+    static constexpr size_t min_candidates_per_sample = 6;
+
+    // two-sided 95% interval of the normal distribution
+    static constexpr double confidence_z = 1.96;
+
+    // shares of the intersected samples as in the Agresti-Coull interval: (hits + 2) / (samples + 4),
+    // so a cell without hits (or without misses) isn't taken for a cell with no spread at all
+    static double getAdjustedShare(size_t intersected_count, size_t samples_count)
+    {
+        return (static_cast<double>(intersected_count) + 2) / (static_cast<double>(samples_count) + 4);
+    }
+
+    const std::vector<Triangle>& in_triangles;
+    std::vector<Task::CountEstimate>& out_estimate;
+    const size_t samples_per_triangle;
+    const size_t triangles_count;
+    const size_t num_of_threads;
+    std::vector<BoundingBox> boxes;
+    PreparedTriangles prepared;
+    const PairKernel& kernel;
+    UniformGrid grid;
+    Barrier barrier;
+    ChunksCounter chunks;
+
+    // samples of the current triangle, the ones which can't count are dropped
+    struct Samples
+    {
+        std::vector<int> triangles;
+        std::vector<size_t> weights; // numbers of the triangles the samples stand for
+        Task::PairCheckStats pairs;
+        uint64_t random = 0;
+    };
+
+
+    // calls onIntersected(k) for the samples k intersecting i
+    template<class OnIntersected>
+    void checkSamples(int i, Samples& samples, OnIntersected&& onIntersected) const
+    {
+        const auto& candidates = samples.triangles;
+        for (size_t k = 0; k < candidates.size(); k += kernel.lanes_count)
+        {
+            int mask = kernel.getCandidatesIntersectionMask(prepared, i, candidates.data() + k,
+                std::min(kernel.lanes_count, candidates.size() - k), samples.pairs);
+            for (size_t lane = 0; mask != 0; ++lane, mask >>= 1)
+            {
+                if (mask & 1)
+                {
+                    onIntersected(k + lane);
+                }
+            }
+        }
+    }
+
+    void addIfCounts(int i, int j, int cell, size_t weight, Samples& samples) const
+    {
+        if (j != i && BoundingBox::areIntersected(boxes[i], boxes[j]) && grid.isPairCell(boxes[i], boxes[j], cell))
+        {
+            samples.triangles.push_back(j);
+            samples.weights.push_back(weight);
+        }
+    }
+
+    Task::CountEstimate estimate(int i, Samples& samples) const
+    {
+        const auto& box = boxes[i];
+        size_t population = 0;
+        grid.forEachCell(box, [&](int, const int* begin, const int* end) { population += end - begin; });
+
+        if (population <= samples_per_triangle)
+        {
+            samples.triangles.clear();
+            samples.weights.clear();
+            grid.forEachCell(box, [&](int cell, const int* begin, const int* end)
+            {
+                for (const int* item = begin; item != end; ++item)
+                {
+                    addIfCounts(i, *item, cell, 1, samples);
+                }
+            });
+            float count = 0;
+            checkSamples(i, samples, [&](size_t) { ++count; });
+            return { count, count, count };
+        }
+
+        // a cell of n triangles with m samples is split into m ranges of about n / m triangles,
+        // and a random triangle of every range stands for the whole range
+        samples.random = static_cast<uint64_t>(i); // the samples of a triangle depend only on its index
+        double count = 0;
+        double variance = 0;
+        double single_samples_variance = 0; // of the cells with one sample, without p * (1 - p)
+        size_t sampled_count = 0;
+        size_t intersected_count = 0;
+        grid.forEachCell(box, [&](int cell, const int* begin, const int* end)
+        {
+            const size_t cell_size = end - begin;
+            if (cell_size == 0)
+            {
+                return;
+            }
+            const size_t cell_samples_count = std::min(cell_size,
+                std::max<size_t>(1, (cell_size * samples_per_triangle + population / 2) / population));
+
+            samples.triangles.clear();
+            samples.weights.clear();
+            for (size_t k = 0; k < cell_samples_count; ++k)
+            {
+                const size_t range_begin = k * cell_size / cell_samples_count;
+                const size_t range_end = (k + 1) * cell_size / cell_samples_count;
+                const int j = begin[range_begin + getRandomIndex(samples.random, range_end - range_begin)];
+                addIfCounts(i, j, cell, range_end - range_begin, samples);
+            }
+
+            double cell_count = 0;
+            size_t cell_intersected_count = 0;
+            checkSamples(i, samples, [&](size_t k)
+            {
+                cell_count += static_cast<double>(samples.weights[k]);
+                ++cell_intersected_count;
+            });
+            count += cell_count;
+            sampled_count += cell_samples_count;
+            intersected_count += cell_intersected_count;
+
+            // variance of the estimate of the cell, as if its samples were taken without replacement
+            const double n = static_cast<double>(cell_size);
+            const double m = static_cast<double>(cell_samples_count);
+            const double finite_population = 1 - m / n;
+            if (cell_samples_count > 1)
+            {
+                const double p = getAdjustedShare(cell_intersected_count, cell_samples_count);
+                variance += n * n * finite_population * p * (1 - p) / (m - 1);
+            }
+            else
+            {
+                single_samples_variance += n * n * finite_population;
+            }
+        });
+
+        // a single sample tells nothing about the spread in its cell, the share of all the samples is used instead
+        const double p = getAdjustedShare(intersected_count, sampled_count);
+        variance += single_samples_variance * p * (1 - p);
+
+        // the intersected samples are there for sure, the rest of the samples are not
+        const double half_width = confidence_z * std::sqrt(variance);
+        const double lower = std::max(count - half_width, static_cast<double>(intersected_count));
+        const double upper = std::min(count + half_width,
+            static_cast<double>(population - (sampled_count - intersected_count)));
+        return { static_cast<float>(count), static_cast<float>(lower), static_cast<float>(upper) };
+    }
+
+    // the samples of all the triangles against the candidates the uniform grid would check
+    bool isSamplingFaster() const
+    {
+        size_t samples_count = 0;
+        size_t candidates_count = 0;
+        for (const auto& box : boxes)
+        {
+            size_t population = 0;
+            grid.forEachCell(box, [&](int, const int* begin, const int* end) { population += end - begin; });
+            samples_count += std::min(population, samples_per_triangle);
+            candidates_count += population;
+        }
+        return candidates_count >= min_candidates_per_sample * samples_count;
+    }
+
+    void estimatePortion(size_t current_portion)
+    {
+        prepared.prepare(in_triangles, triangles_count * current_portion / num_of_threads,
+            triangles_count * (current_portion + 1) / num_of_threads);
+        barrier.wait();
+
+        Samples samples;
+        size_t chunk_begin, chunk_end;
+        while (chunks.getNextChunk(chunk_begin, chunk_end))
+        {
+            for (size_t i = chunk_begin; i < chunk_end; ++i)
+            {
+                out_estimate[i] = estimate(static_cast<int>(i), samples);
+            }
+        }
+    }
+
+public:
+    IntersectionsEstimator(const std::vector<Triangle>& in_triangles, std::vector<Task::CountEstimate>& out_estimate,
+        size_t samples_per_triangle, size_t num_of_threads = std::max(std::thread::hardware_concurrency(), 1u)) :
+        in_triangles(in_triangles),
+        out_estimate(out_estimate),
+        samples_per_triangle(std::max<size_t>(1, samples_per_triangle)),
+        triangles_count(in_triangles.size()),
+        num_of_threads(num_of_threads),
+        kernel(PairKernel::get()),
+        barrier(num_of_threads)
+    {
+    }
+
+    void estimate()
+    {
+        out_estimate.resize(triangles_count);
+        if (triangles_count == 0)
+        {
+            return;
+        }
+
+        boxes.reserve(triangles_count);
+        for (const auto& tri : in_triangles)
+        {
+            boxes.push_back(BoundingBox::fromTriangle(tri));
+        }
+        grid.build(boxes);
+
+        // in sparse scenes most of the triangles have fewer candidates than samples,
+        // the exact numbers take less time then
+        if (!isSamplingFaster())
+        {
+            std::vector<int> count;
+            IntersectionsChecker checker(in_triangles, count, Task::Engine::UniformGrid, {}, num_of_threads);
+            checker.fillIntersectionsVector();
+            for (size_t i = 0; i < triangles_count; ++i)
+            {
+                const float value = static_cast<float>(count[i]);
+                out_estimate[i] = { value, value, value };
+            }
+            return;
+        }
+
+        prepared.resize(triangles_count);
+        chunks.reset(triangles_count, num_of_threads * chunks_per_thread);
+
+        std::vector<std::thread> threads;
+        threads.reserve(num_of_threads);
+        for (size_t i = 0; i < num_of_threads; ++i)
+        {
+            threads.emplace_back(&IntersectionsEstimator::estimatePortion, this, i);
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+    }
+};
+
+
+struct Task::WorkerPool::Impl
+{
+    const size_t threads_count;
+    const bool pin_threads;
+    std::vector<std::thread> threads;
+
+    std::mutex run_mutex; // one call at a time
+    std::mutex mutex;
+    std::condition_variable task_ready;
+    std::condition_variable task_done;
+    const std::function<void(size_t)>* task = nullptr;
+    size_t generation = 0;
+    size_t running_count = 0;
+    bool is_stopping = false;
+
+    Impl(size_t threads_count, bool pin_threads) :
+        threads_count(threads_count != 0 ? threads_count : std::max(std::thread::hardware_concurrency(), 1u)),
+        pin_threads(pin_threads)
+    {
+    }
+
+    ~Impl()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_stopping = true;
+        }
+        task_ready.notify_all();
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+    }
+
+    void run(const std::function<void(size_t)>& new_task)
+    {
+        std::lock_guard<std::mutex> run_lock(run_mutex);
+        if (threads.empty())
+        {
+            start();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        task = &new_task;
+        running_count = threads_count;
+        ++generation;
+        task_ready.notify_all();
+        task_done.wait(lock, [this] { return running_count == 0; });
+        task = nullptr;
+    }
+
+private:
+    void start()
+    {
+        threads.reserve(threads_count);
+        for (size_t i = 0; i < threads_count; ++i)
+        {
+            threads.emplace_back(&Impl::work, this, i);
+            if (pin_threads)
+            {
+                pinThread(threads.back(), i % std::max(std::thread::hardware_concurrency(), 1u));
+            }
+        }
+    }
+
+    static void pinThread(std::thread& thread, size_t core)
+    {
+#if defined(_WIN32)
+        SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << core);
+#elif defined(__linux__)
+        cpu_set_t cores;
+        CPU_ZERO(&cores);
+        CPU_SET(core, &cores);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cores), &cores);
+#else
+        (void)thread;
+        (void)core;
+#endif
+    }
+
+    void work(size_t index)
+    {
+        size_t done_generation = 0;
+        while (true)
+        {
+            const std::function<void(size_t)>* current_task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                task_ready.wait(lock, [&] { return is_stopping || generation != done_generation; });
+                if (is_stopping)
+                {
+                    return;
+                }
+                done_generation = generation;
+                current_task = task;
+            }
+
+            (*current_task)(index);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--running_count == 0)
+            {
+                task_done.notify_one();
+            }
+        }
+    }
+};
+
+
+Task::WorkerPool::WorkerPool(size_t threads_count, bool pin_threads) :
+    impl(new Impl(threads_count, pin_threads))
+{
+}
+
+Task::WorkerPool::~WorkerPool() = default;
+
+Task::WorkerPool& Task::WorkerPool::getDefault()
+{
+    static WorkerPool pool;
+    return pool;
+}
+
+size_t Task::WorkerPool::getThreadsCount() const
+{
+    return impl->threads_count;
+}
+
+void Task::WorkerPool::checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    Engine engine)
+{
+    MortonOrderedChecker checker(in_triangles, out_count, engine, {}, impl->threads_count);
+    checker.fillIntersectionsVector([this](const std::function<void(size_t)>& task) { impl->run(task); });
+}
+
+void Task::WorkerPool::checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    Engine engine, Stats& stats)
+{
+    CheckExtras extras;
+    extras.stats = &stats;
+    MortonOrderedChecker checker(in_triangles, out_count, engine, extras, impl->threads_count);
+    checker.fillIntersectionsVector([this](const std::function<void(size_t)>& task) { impl->run(task); });
+}
+
+
+// loose grids with cells of 2^level, a triangle is stored in the grid whose cells fit its bounding box,
+// in the cell containing the lower left corner of the box
+// the cells are kept in a hash map, so the grids have no bounds and take memory only for the used cells
+struct Task::IntersectionScene::Impl
+{
+    static constexpr int min_level = -64;
+    static constexpr int levels_count = 193; // up to the cells of 2^128, larger than any finite float
+
+    struct CellKey
+    {
+        int level;
+        int64_t x;
+        int64_t y;
+
+        bool operator==(const CellKey& other) const
+        {
+            return level == other.level && x == other.x && y == other.y;
+        }
+    };
+
+    struct CellKeyHash
+    {
+        size_t operator()(const CellKey& key) const
+        {
+            uint64_t hash = static_cast<uint64_t>(key.level);
+            hash = hash * 0x9E3779B97F4A7C15ull ^ static_cast<uint64_t>(key.x);
+            hash = hash * 0x9E3779B97F4A7C15ull ^ static_cast<uint64_t>(key.y);
+            return static_cast<size_t>(hash ^ (hash >> 29));
+        }
+    };
+
+    // place of a triangle in the grids, level_index < 0 for the ids not in the scene
+    struct Entry
+    {
+        BoundingBox box;
+        int level_index = -1;
+        CellKey cell;
+        size_t cell_position;
+        size_t level_position;
+    };
+
+    std::vector<Triangle> triangles;
+    std::vector<int> counts;
+    std::vector<Entry> entries;
+    std::vector<size_t> free_ids;
+    size_t triangles_count = 0;
+    std::unordered_map<CellKey, std::vector<size_t>, CellKeyHash> cells;
+    std::vector<size_t> levels_items[levels_count];
+
+    // the cells are no smaller than the spacing of the floats at the box (2^-24 of its largest coordinate),
+    // so the cell coordinates stay below 2^25 and the points far from the origin don't share one clamped cell
+    static int getLevelIndex(const BoundingBox& box)
+    {
+        const float magnitude = std::max(std::max(std::fabs(box.min_x), std::fabs(box.max_x)),
+            std::max(std::fabs(box.min_y), std::fabs(box.max_y)));
+        const float size = std::max(std::max(box.max_x - box.min_x, box.max_y - box.min_y), std::ldexp(magnitude, -24));
+        if (!(size > 0))
+        {
+            return 0;
+        }
+        // size <= 2^exponent
+        int exponent;
+        std::frexp(size, &exponent);
+        return std::min(std::max(exponent - min_level, 0), levels_count - 1);
+    }
+
+    static int64_t getCellCoordinate(float value, int level_index)
+    {
+        const double coordinate = std::floor(std::ldexp(static_cast<double>(value), -(level_index + min_level)));
+        const double limit = 4e18;
+        return static_cast<int64_t>(std::min(std::max(coordinate, -limit), limit));
+    }
+
+    static CellKey getCell(const BoundingBox& box, int level_index)
+    {
+        return { level_index, getCellCoordinate(box.min_x, level_index), getCellCoordinate(box.min_y, level_index) };
+    }
+
+    // calls fn(j) for every triangle j of the scene whose bounding box intersects the box
+    template<class Fn>
+    void forEachNeighbour(const BoundingBox& box, Fn&& fn) const
+    {
+        for (int level_index = 0; level_index < levels_count; ++level_index)
+        {
+            const auto& level_items = levels_items[level_index];
+            if (level_items.empty())
+            {
+                continue;
+            }
+
+            // the lower left corners of the intersecting boxes are at most a cell away from the box
+            const int64_t begin_x = getCellCoordinate(box.min_x, level_index) - 1;
+            const int64_t begin_y = getCellCoordinate(box.min_y, level_index) - 1;
+            const int64_t end_x = getCellCoordinate(box.max_x, level_index);
+            const int64_t end_y = getCellCoordinate(box.max_y, level_index);
+
+            // a box much larger than the cells covers more cells than there are triangles in the grid
+            const double cells_count =
+                (static_cast<double>(end_x - begin_x) + 1) * (static_cast<double>(end_y - begin_y) + 1);
+            if (cells_count > static_cast<double>(level_items.size()))
+            {
+                for (size_t j : level_items)
+                {
+                    if (BoundingBox::areIntersected(box, entries[j].box))
+                    {
+                        fn(j);
+                    }
+                }
+                continue;
+            }
+
+            for (int64_t y = begin_y; y <= end_y; ++y)
+            {
+                for (int64_t x = begin_x; x <= end_x; ++x)
+                {
+                    auto cell = cells.find({ level_index, x, y });
+                    if (cell == cells.end())
+                    {
+                        continue;
+                    }
+                    for (size_t j : cell->second)
+                    {
+                        if (BoundingBox::areIntersected(box, entries[j].box))
+                        {
+                            fn(j);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // adds value to the counters of the triangle id and of all the triangles it intersects
+    void addToIntersected(size_t id, int value)
+    {
+        const auto& triangle = triangles[id];
+        int count = 0;
+        forEachNeighbour(entries[id].box, [&](size_t j)
+        {
+            if (j != id && areIntersected(triangle, triangles[j]))
+            {
+                counts[j] += value;
+                count += value;
+            }
+        });
+        counts[id] += count;
+    }
+
+    void store(size_t id)
+    {
+        auto& entry = entries[id];
+        entry.level_index = getLevelIndex(entry.box);
+        entry.cell = getCell(entry.box, entry.level_index);
+
+        auto& cell_items = cells[entry.cell];
+        entry.cell_position = cell_items.size();
+        cell_items.push_back(id);
+
+        auto& level_items = levels_items[entry.level_index];
+        entry.level_position = level_items.size();
+        level_items.push_back(id);
+    }
+
+    // the last items of the cell and the level take the places of the removed one
+    void unstore(size_t id)
+    {
+        auto& entry = entries[id];
+
+        auto cell = cells.find(entry.cell);
+        auto& cell_items = cell->second;
+        cell_items[entry.cell_position] = cell_items.back();
+        entries[cell_items.back()].cell_position = entry.cell_position;
+        cell_items.pop_back();
+        if (cell_items.empty())
+        {
+            cells.erase(cell);
+        }
+
+        auto& level_items = levels_items[entry.level_index];
+        level_items[entry.level_position] = level_items.back();
+        entries[level_items.back()].level_position = entry.level_position;
+        level_items.pop_back();
+
+        entry.level_index = -1;
+    }
+};
+
+
+Task::IntersectionScene::IntersectionScene(const std::vector<Triangle>& in_triangles) :
+    impl(new Impl)
+{
+    impl->triangles = in_triangles;
+    impl->triangles_count = in_triangles.size();
+    impl->entries.resize(in_triangles.size());
+    checkIntersections(in_triangles, impl->counts);
+    for (size_t id = 0; id < in_triangles.size(); ++id)
+    {
+        impl->entries[id].box = BoundingBox::fromTriangle(in_triangles[id]);
+        impl->store(id);
+    }
+}
+
+Task::IntersectionScene::~IntersectionScene() = default;
+
+size_t Task::IntersectionScene::insert(const Triangle& triangle)
+{
+    size_t id;
+    if (!impl->free_ids.empty())
+    {
+        id = impl->free_ids.back();
+        impl->free_ids.pop_back();
+        impl->triangles[id] = triangle;
+    }
+    else
+    {
+        id = impl->triangles.size();
+        impl->triangles.push_back(triangle);
+        impl->counts.push_back(0);
+        impl->entries.emplace_back();
+    }
+
+    impl->entries[id].box = BoundingBox::fromTriangle(triangle);
+    impl->addToIntersected(id, 1);
+    impl->store(id);
+    ++impl->triangles_count;
+    return id;
+}
+
+void Task::IntersectionScene::erase(size_t id)
+{
+    impl->unstore(id);
+    impl->addToIntersected(id, -1);
+    impl->counts[id] = 0;
+    impl->free_ids.push_back(id);
+    --impl->triangles_count;
+}
+
+void Task::IntersectionScene::update(size_t id, const Triangle& triangle)
+{
+    impl->unstore(id);
+    impl->addToIntersected(id, -1);
+    impl->triangles[id] = triangle;
+    impl->entries[id].box = BoundingBox::fromTriangle(triangle);
+    impl->addToIntersected(id, 1);
+    impl->store(id);
+}
+
+bool Task::IntersectionScene::contains(size_t id) const
+{
+    return id < impl->entries.size() && impl->entries[id].level_index >= 0;
+}
+
+const Triangle& Task::IntersectionScene::getTriangle(size_t id) const
+{
+    return impl->triangles[id];
+}
+
+size_t Task::IntersectionScene::size() const
+{
+    return impl->triangles_count;
+}
+
+int Task::IntersectionScene::getIntersectionsCount(size_t id) const
+{
+    return impl->counts[id];
+}
+
+const std::vector<int>& Task::IntersectionScene::getIntersectionsCounts() const
+{
+    return impl->counts;
+}
+
+
+// the set is kept in a bounding volume hierarchy, a query is checked against the leaves its box touches
+// every thread prepares its query in its own slot after the set, so the pair kernels find both in one place
+struct Task::IntersectionIndex::Impl
+{
+    // fewer queries are checked on the calling thread, waking the pool costs more than they do
+    static constexpr size_t min_queries_per_thread = 64;
+    static constexpr size_t min_triangles_per_thread = 4096;
+    static constexpr size_t chunks_per_thread = 16;
+
+    // a thread's query and candidates
+    struct Slot
+    {
+        std::vector<int> candidates;
+        std::vector<int> stack;
+        Task::PairCheckStats pairs;
+    };
+
+    WorkerPool& pool;
+    const size_t triangles_count;
+    const PairKernel& kernel;
+    BoundingVolumeHierarchy hierarchy;
+    PreparedTriangles prepared;
+    std::vector<Slot> slots;
+    ChunksCounter chunks;
+    std::mutex mutex; // one batch at a time, the slots are shared
+
+    Impl(const std::vector<Triangle>& in_triangles, WorkerPool& pool) :
+        pool(pool),
+        triangles_count(in_triangles.size()),
+        kernel(PairKernel::get()),
+        slots(pool.getThreadsCount())
+    {
+        prepared.resize(getSlotIndex(slots.size()));
+        if (triangles_count == 0)
+        {
+            return;
+        }
+
+        std::vector<BoundingBox> boxes;
+        boxes.reserve(triangles_count);
+        for (const auto& tri : in_triangles)
+        {
+            boxes.push_back(BoundingBox::fromTriangle(tri));
+        }
+
+        const size_t threads_count = getThreadsCount(triangles_count, min_triangles_per_thread);
+        hierarchy.buildTop(boxes, std::max<size_t>(1024, triangles_count / (threads_count * chunks_per_thread)));
+        chunks.reset(hierarchy.getSubtreesCount(), hierarchy.getSubtreesCount());
+        run(threads_count, [&](size_t thread)
+        {
+            prepared.prepare(in_triangles, triangles_count * thread / threads_count,
+                triangles_count * (thread + 1) / threads_count);
+
+            size_t begin, end;
+            while (chunks.getNextChunk(begin, end))
+            {
+                for (size_t subtree = begin; subtree < end; ++subtree)
+                {
+                    hierarchy.buildSubtree(subtree, boxes);
+                }
+            }
+        });
+    }
+
+    // the slots are a register apart, so the threads don't write to the same cache lines
+    size_t getSlotIndex(size_t thread) const
+    {
+        return triangles_count + thread * PreparedTriangles::max_lanes_count;
+    }
+
+    size_t getThreadsCount(size_t items_count, size_t min_items_per_thread) const
+    {
+        return std::max<size_t>(1, std::min(slots.size(), items_count / min_items_per_thread));
+    }
+
+    // task(0), ..., task(threads_count - 1), on the calling thread if there is only one
+    void run(size_t threads_count, const std::function<void(size_t)>& task)
+    {
+        if (threads_count == 1)
+        {
+            task(0);
+            return;
+        }
+        pool.impl->run([&](size_t thread)
+        {
+            if (thread < threads_count)
+            {
+                task(thread);
+            }
+        });
+    }
+
+    // out_set_count may be null, max_count = 0 means no limit, it's ignored with out_set_count
+    void countIntersections(const std::vector<Triangle>& queries, std::vector<int>& out_count,
+        std::vector<int>* out_set_count, int max_count)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        out_count.assign(queries.size(), 0);
+        if (out_set_count != nullptr)
+        {
+            out_set_count->assign(triangles_count, 0);
+        }
+        if (triangles_count == 0)
+        {
+            return;
+        }
+
+        const size_t threads_count = getThreadsCount(queries.size(), min_queries_per_thread);
+        std::unique_ptr<IntersectionCounters> set_counters(out_set_count != nullptr ?
+            new IntersectionCounters(triangles_count, threads_count) : nullptr);
+        chunks.reset(queries.size(), threads_count * chunks_per_thread);
+        run(threads_count, [&](size_t thread)
+        {
+            size_t begin, end;
+            if (set_counters == nullptr)
+            {
+                while (chunks.getNextChunk(begin, end))
+                {
+                    for (size_t query = begin; query < end; ++query)
+                    {
+                        out_count[query] = countIntersections(thread, queries[query], max_count, [](int, int) {});
+                    }
+                }
+                return;
+            }
+
+            auto counters = set_counters->getBlock(thread);
+            while (chunks.getNextChunk(begin, end))
+            {
+                for (size_t query = begin; query < end; ++query)
+                {
+                    out_count[query] = countIntersections(thread, queries[query], 0, [&](int mask, int first)
+                    {
+                        for (int lane = 0; mask != 0; ++lane, mask >>= 1)
+                        {
+                            if (mask & 1)
+                            {
+                                counters.increment(slots[thread].candidates[first + lane]);
+                            }
+                        }
+                    });
+                }
+            }
+        });
+
+        if (set_counters != nullptr)
+        {
+            run(threads_count, [&](size_t thread)
+            {
+                set_counters->reduce(*out_set_count, triangles_count * thread / threads_count,
+                    triangles_count * (thread + 1) / threads_count);
+            });
+        }
+    }
+
+    // onIntersected(mask, first) gets the intersected candidates[first + k] as the bits k of the mask
+    // the check stops as soon as max_count intersections are found, unless max_count is 0
+    template<class OnIntersected>
+    int countIntersections(size_t thread, const Triangle& query, int max_count, OnIntersected&& onIntersected)
+    {
+        auto& slot = slots[thread];
+        const size_t i = getSlotIndex(thread);
+        prepared.prepare(i, query);
+
+        slot.candidates.clear();
+        hierarchy.collectItems(BoundingBox::fromTriangle(query), slot.candidates, slot.stack);
+
+        const auto& candidates = slot.candidates;
+        int count = 0;
+        for (size_t k = 0; k < candidates.size(); k += kernel.lanes_count)
+        {
+            const int mask = kernel.getCandidatesIntersectionMask(prepared, i, candidates.data() + k,
+                std::min(kernel.lanes_count, candidates.size() - k), slot.pairs);
+            if (mask != 0)
+            {
+                count += static_cast<int>(countBits(mask));
+                onIntersected(mask, static_cast<int>(k));
+                if (max_count > 0 && count >= max_count)
+                {
+                    return max_count;
+                }
+            }
+        }
+        return count;
+    }
+};
+
+
+Task::IntersectionIndex::IntersectionIndex(const std::vector<Triangle>& in_triangles, WorkerPool& pool) :
+    impl(new Impl(in_triangles, pool))
+{
+}
+
+Task::IntersectionIndex::~IntersectionIndex() = default;
+
+size_t Task::IntersectionIndex::size() const
+{
+    return impl->triangles_count;
+}
+
+void Task::IntersectionIndex::countIntersections(const std::vector<Triangle>& queries,
+    std::vector<int>& out_count) const
+{
+    impl->countIntersections(queries, out_count, nullptr, 0);
+}
+
+void Task::IntersectionIndex::countIntersections(const std::vector<Triangle>& queries, std::vector<int>& out_count,
+    int max_count) const
+{
+    impl->countIntersections(queries, out_count, nullptr, max_count);
+}
+
+void Task::IntersectionIndex::countIntersections(const std::vector<Triangle>& queries, std::vector<int>& out_count,
+    std::vector<int>& out_set_count) const
+{
+    impl->countIntersections(queries, out_count, &out_set_count, 0);
+}
+
+
+void Task::checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count)
+{
+    checkIntersections(in_triangles, out_count, Engine::Automatic);
+}
+
+void Task::checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count, Engine engine)
+{
+    MortonOrderedChecker checker(in_triangles, out_count, engine);
+    checker.fillIntersectionsVector();
+}
+
+void Task::checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count, Engine engine,
+    Stats& stats)
+{
+    CheckExtras extras;
+    extras.stats = &stats;
+    MortonOrderedChecker checker(in_triangles, out_count, engine, extras);
+    checker.fillIntersectionsVector();
+}
+
+struct Task::CoherenceState::Impl
+{
+    SweepCache sweep_cache;
+};
+
+
+Task::CoherenceState::CoherenceState() :
+    impl(new Impl)
+{
+}
+
+Task::CoherenceState::~CoherenceState() = default;
+
+void Task::CoherenceState::reset()
+{
+    impl->sweep_cache.triangles_count = 0;
+}
+
+void Task::checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    CoherenceState& state)
+{
+    CheckExtras extras;
+    extras.sweep_cache = &state.impl->sweep_cache;
+    IntersectionsChecker checker(in_triangles, out_count, Engine::SweepAndPrune, extras);
+    checker.fillIntersectionsVector();
+}
+
+void Task::checkIntersections(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    CoherenceState& state, Stats& stats)
+{
+    CheckExtras extras;
+    extras.stats = &stats;
+    extras.sweep_cache = &state.impl->sweep_cache;
+    IntersectionsChecker checker(in_triangles, out_count, Engine::SweepAndPrune, extras);
+    checker.fillIntersectionsVector();
+}
+
+void Task::checkIntersections(const std::vector<Triangle>& in_triangles, Adjacency& out_adjacency, Engine engine)
+{
+    std::vector<int> count;
+    CheckExtras extras;
+    extras.out_adjacency = &out_adjacency;
+    MortonOrderedChecker checker(in_triangles, count, engine, extras);
+    checker.fillIntersectionsVector();
+}
+
+// the smaller set is indexed, the larger one goes through the index
+void Task::checkIntersections(const std::vector<Triangle>& in_triangles_a, const std::vector<Triangle>& in_triangles_b,
+    std::vector<int>& out_count_a, std::vector<int>& out_count_b)
+{
+    if (in_triangles_a.size() <= in_triangles_b.size())
+    {
+        IntersectionIndex index(in_triangles_a);
+        index.countIntersections(in_triangles_b, out_count_b, out_count_a);
+    }
+    else
+    {
+        IntersectionIndex index(in_triangles_b);
+        index.countIntersections(in_triangles_a, out_count_a, out_count_b);
+    }
+}
+
+void Task::checkIntersectionsUpTo(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count, int max_count,
+    Engine engine)
+{
+    CheckExtras extras;
+    extras.max_count = max_count;
+    MortonOrderedChecker checker(in_triangles, out_count, engine, extras);
+    checker.fillIntersectionsVector();
+}
+
+void Task::checkIntersectionsExactly(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    Engine engine)
+{
+    CheckExtras extras;
+    extras.is_exact = true;
+    MortonOrderedChecker checker(in_triangles, out_count, engine, extras);
+    checker.fillIntersectionsVector();
+}
+
+bool Task::checkIntersectionsOnGrid(const std::vector<Triangle>& in_triangles, std::vector<int>& out_count,
+    GridQuantization& out_quantization, Engine engine)
+{
+    GridMapping mapping;
+    if (!mapping.build(in_triangles))
+    {
+        return false;
+    }
+    out_quantization.step = mapping.getStep();
+    out_quantization.origin_x = mapping.getOriginX();
+    out_quantization.origin_y = mapping.getOriginY();
+    out_quantization.bits = mapping.isNarrow() ? 16 : 32;
+    out_quantization.kernel = PairKernel::getOnGrid(mapping.isNarrow()).name;
+
+    CheckExtras extras;
+    extras.grid_mapping = &mapping;
+    MortonOrderedChecker checker(in_triangles, out_count, engine, extras);
+    checker.fillIntersectionsVector();
+    return true;
+}
+
+void Task::estimateIntersections(const std::vector<Triangle>& in_triangles, std::vector<CountEstimate>& out_estimate,
+    size_t samples_per_triangle)
+{
+    IntersectionsEstimator estimator(in_triangles, out_estimate, samples_per_triangle);
+    estimator.estimate();
+}
+
+void Task::findComponents(const std::vector<Triangle>& in_triangles, std::vector<int>& out_component, Engine engine)
+{
+    std::vector<int> count;
+    CheckExtras extras;
+    extras.out_component = &out_component;
+    MortonOrderedChecker checker(in_triangles, count, engine, extras);
+    checker.fillIntersectionsVector();
+}
+
+const char* Task::getPairKernelName()
+{
+    return PairKernel::get().name;
 }
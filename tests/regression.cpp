@@ -0,0 +1,887 @@
+// regression checks of the intersection functions, run by ctest
+//
+// regression --save <file>     writes the numbers of the intersections found by Engine::BruteForce
+// regression --compare <file>  checks every engine of this process against the saved numbers
+//
+// the kernel is chosen once per process (TASK_PAIR_KERNEL), so ctest saves the numbers of the scalar kernel
+// and compares every kernel with them in separate processes
+
+#include "intersections.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+struct Scene
+{
+    const char* name;
+    std::vector<Triangle> triangles;
+    bool has_large_triangles = false; // the uniform grid must count some of the pairs by the covered cells
+};
+
+// results of the scalar brute force for a scene
+struct Expected
+{
+    std::vector<int> count;
+    std::vector<std::vector<int>> neighbours; // of every triangle, in ascending order
+    std::vector<int> component;               // the smallest index in the group of every triangle
+};
+
+bool is_passed = true;
+
+void fail(const Scene& scene, const std::string& what)
+{
+    std::printf("FAIL %s: %s with kernel %s\n", scene.name, what.c_str(), Task::getPairKernelName());
+    is_passed = false;
+}
+
+Point getRandomPoint(std::mt19937& random, float size)
+{
+    std::uniform_real_distribution<float> coordinate(0, size);
+    return { coordinate(random), coordinate(random) };
+}
+
+// the vertices are on a 1/64 grid shifted by 0.001, so many pairs touch within the rounding errors
+// and any change of the float operations changes some of the results
+std::vector<Triangle> makeBorderlineScene(size_t count, int size, int extent, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> corner(0, 64 * size);
+    std::uniform_int_distribution<int> offset(0, 64 * extent);
+
+    std::vector<Triangle> triangles(count);
+    for (auto& tri : triangles)
+    {
+        const int x = corner(random);
+        const int y = corner(random);
+        auto getPoint = [&]
+        {
+            return Point{ (x + offset(random)) / 64.0f + 0.001f, (y + offset(random)) / 64.0f + 0.001f };
+        };
+        tri = { getPoint(), getPoint(), getPoint() };
+    }
+    return triangles;
+}
+
+// small triangles scattered over a square of the given size
+std::vector<Triangle> makeRandomScene(size_t count, float size, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> offset(0, 3);
+    std::vector<Triangle> triangles(count);
+    for (auto& tri : triangles)
+    {
+        const Point center = getRandomPoint(random, size);
+        tri = {
+                { center.x + offset(random), center.y + offset(random) },
+                { center.x + offset(random), center.y + offset(random) },
+                { center.x + offset(random), center.y + offset(random) }
+        };
+    }
+    return triangles;
+}
+
+// a few large triangles over many small ones, half of them before the small ones and half after them
+std::vector<Triangle> makeOverlayScene(size_t count, float size, size_t large_count, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::vector<Triangle> triangles;
+    for (size_t i = 0; i < large_count; ++i)
+    {
+        const Point a = getRandomPoint(random, size);
+        const Point b = getRandomPoint(random, size);
+        triangles.push_back({ a, b, getRandomPoint(random, size) });
+    }
+    const auto small = makeRandomScene(count, size, seed);
+    triangles.insert(triangles.begin() + large_count / 2, small.begin(), small.end());
+    return triangles;
+}
+
+// triangles of zero size far from the origin, on a 1/8 grid of size x size points, so some of them coincide
+std::vector<Triangle> makePointScene(size_t count, int size, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> step(0, size - 1);
+    std::vector<Triangle> triangles(count);
+    for (auto& tri : triangles)
+    {
+        const Point point{ 1000 + step(random) / 8.0f, 2000 + step(random) / 8.0f };
+        tri = { point, point, point };
+    }
+    return triangles;
+}
+
+std::vector<Scene> makeScenes()
+{
+    return {
+            { "empty", {} },
+            { "single", { { { 0, 0 }, { 1, 0 }, { 0, 1 } } } },
+            { "borderline", makeBorderlineScene(2000, 16, 4, 1) },
+            { "sparse", makeRandomScene(3000, 200, 2) },
+            // above the size from which the triangles are checked in Morton order
+            { "reordered", makeRandomScene(5000, 300, 4) },
+            { "overlays", makeOverlayScene(2500, 100, 8, 5), true },
+            { "points", makePointScene(1500, 40, 6) },
+            { "dense", makeRandomScene(1000, 10, 3) },
+    };
+}
+
+const Task::Engine engines[] = {
+        Task::Engine::BruteForce,
+        Task::Engine::TiledBruteForce,
+        Task::Engine::UniformGrid,
+        Task::Engine::SweepAndPrune,
+        Task::Engine::BoundingVolumeHierarchy,
+        Task::Engine::HierarchicalGrid,
+        Task::Engine::Automatic,
+};
+
+const char* getEngineName(Task::Engine engine)
+{
+    switch (engine)
+    {
+    case Task::Engine::BruteForce:
+        return "brute force";
+    case Task::Engine::TiledBruteForce:
+        return "tiled brute force";
+    case Task::Engine::UniformGrid:
+        return "uniform grid";
+    case Task::Engine::SweepAndPrune:
+        return "sweep and prune";
+    case Task::Engine::BoundingVolumeHierarchy:
+        return "bounding volume hierarchy";
+    case Task::Engine::HierarchicalGrid:
+        return "hierarchical grid";
+    case Task::Engine::Automatic:
+        return "automatic choice";
+    }
+    return "unknown";
+}
+
+// more threads than this machine may have, so some of them get no work in small scenes
+Task::WorkerPool& getPool()
+{
+    static Task::WorkerPool pool(3);
+    return pool;
+}
+
+// the lists must be the expected ones, element by element
+bool isAdjacencyOf(const Task::Adjacency& adjacency, const Expected& expected)
+{
+    const size_t count = expected.neighbours.size();
+    if (adjacency.offsets.size() != count + 1 || adjacency.offsets[0] != 0 ||
+        adjacency.neighbours.size() != adjacency.offsets.back())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        const auto& list = expected.neighbours[i];
+        if (adjacency.offsets[i + 1] - adjacency.offsets[i] != list.size() ||
+            !std::equal(list.begin(), list.end(), adjacency.neighbours.begin() + adjacency.offsets[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the lists are ascending, without the triangle itself, and every pair is in the lists of both triangles
+bool isSymmetric(const std::vector<std::vector<int>>& neighbours)
+{
+    for (size_t i = 0; i < neighbours.size(); ++i)
+    {
+        const auto& list = neighbours[i];
+        for (size_t k = 0; k < list.size(); ++k)
+        {
+            const int j = list[k];
+            if (j < 0 || static_cast<size_t>(j) >= neighbours.size() || static_cast<size_t>(j) == i ||
+                (k > 0 && list[k - 1] >= j) ||
+                !std::binary_search(neighbours[j].begin(), neighbours[j].end(), static_cast<int>(i)))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// plain union-find over the pairs, the root of a group is its smallest index
+std::vector<int> getComponents(const std::vector<std::vector<int>>& neighbours)
+{
+    std::vector<int> parent(neighbours.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](int i)
+    {
+        while (parent[i] != i)
+        {
+            i = parent[i] = parent[parent[i]];
+        }
+        return i;
+    };
+    for (size_t i = 0; i < neighbours.size(); ++i)
+    {
+        for (int j : neighbours[i])
+        {
+            const int a = find(static_cast<int>(i));
+            const int b = find(j);
+            parent[std::max(a, b)] = std::min(a, b);
+        }
+    }
+    for (size_t i = 0; i < neighbours.size(); ++i)
+    {
+        parent[i] = find(static_cast<int>(i));
+    }
+    return parent;
+}
+
+const int max_counts[] = { 1, 2, 5 };
+
+std::vector<int> getCapped(const std::vector<int>& count, int max_count)
+{
+    std::vector<int> capped(count);
+    for (int& value : capped)
+    {
+        value = std::min(value, max_count);
+    }
+    return capped;
+}
+
+// every intersected pair adds 1 to the numbers of both triangles
+size_t getPairsCount(const std::vector<int>& count)
+{
+    size_t sum = 0;
+    for (int value : count)
+    {
+        sum += static_cast<size_t>(value);
+    }
+    return sum / 2;
+}
+
+// the checked pairs not rejected by any stage and the ones counted by the covered cells are the intersected ones
+bool areStatsOf(const Task::Stats& stats, const std::vector<int>& count)
+{
+    const auto& pairs = stats.pairs;
+    return pairs.checked - pairs.rejected_by_bounding_boxes - pairs.rejected_by_first_triangle -
+            pairs.rejected_by_second_triangle + pairs.counted_by_covered_cells == getPairsCount(count);
+}
+
+void checkEngines(const Scene& scene, const Expected& expected)
+{
+    for (auto engine : engines)
+    {
+        std::vector<int> count(1, -1); // stale contents must be replaced
+        Task::checkIntersections(scene.triangles, count, engine);
+        if (count != expected.count)
+        {
+            fail(scene, std::string("counts of ") + getEngineName(engine));
+        }
+
+        count.assign(1, -1);
+        Task::WorkerPool::getDefault().checkIntersections(scene.triangles, count, engine);
+        if (count != expected.count)
+        {
+            fail(scene, std::string("counts on the default pool of ") + getEngineName(engine));
+        }
+
+        count.assign(1, -1);
+        Task::Stats stats;
+        getPool().checkIntersections(scene.triangles, count, engine, stats);
+        if (count != expected.count || stats.threads_busy_time.size() != getPool().getThreadsCount())
+        {
+            fail(scene, std::string("counts on a pool of 3 threads of ") + getEngineName(engine));
+        }
+        const bool is_covered = engine != Task::Engine::UniformGrid || !scene.has_large_triangles ||
+            stats.pairs.counted_by_covered_cells > 0;
+        if (!areStatsOf(stats, expected.count) || !is_covered)
+        {
+            fail(scene, std::string("stats of the pairs of ") + getEngineName(engine));
+        }
+        // the chosen engine is reported, the others as they are
+        const bool is_chosen = engine == Task::Engine::Automatic ? stats.engine != Task::Engine::Automatic :
+                                                                     stats.engine == engine;
+        if (!is_chosen || !(stats.scene.overlap_degree >= 0) || !(stats.scene.size_spread >= 1))
+        {
+            fail(scene, std::string("engine and scene in the stats of ") + getEngineName(engine));
+        }
+
+        Task::Adjacency adjacency;
+        adjacency.offsets.assign(2, 7);
+        adjacency.neighbours.assign(7, -1);
+        Task::checkIntersections(scene.triangles, adjacency, engine);
+        if (!isAdjacencyOf(adjacency, expected))
+        {
+            fail(scene, std::string("adjacency of ") + getEngineName(engine));
+        }
+
+        for (int max_count : max_counts)
+        {
+            count.assign(1, -1);
+            Task::checkIntersectionsUpTo(scene.triangles, count, max_count, engine);
+            if (count != getCapped(expected.count, max_count))
+            {
+                fail(scene, "counts up to " + std::to_string(max_count) + " of " + getEngineName(engine));
+            }
+        }
+
+        std::vector<int> component(1, -1);
+        Task::findComponents(scene.triangles, component, engine);
+        if (component != expected.component)
+        {
+            fail(scene, std::string("components of ") + getEngineName(engine));
+        }
+    }
+}
+
+// the scene counts the pairs of the given triangles at once and the changed triangles one by one,
+// both must give the same numbers
+void checkIntersectionScene(const Scene& scene, const Expected& expected)
+{
+    Task::IntersectionScene built(scene.triangles);
+    if (built.getIntersectionsCounts() != expected.count)
+    {
+        fail(scene, "counts of the intersection scene");
+    }
+
+    // moved far away and back
+    for (size_t id = 0; id < scene.triangles.size(); id += 7)
+    {
+        const auto& tri = scene.triangles[id];
+        built.update(id, { { tri.a.x + 1e6f, tri.a.y }, { tri.b.x + 1e6f, tri.b.y }, { tri.c.x + 1e6f, tri.c.y } });
+        built.update(id, tri);
+    }
+    if (built.getIntersectionsCounts() != expected.count)
+    {
+        fail(scene, "counts of the intersection scene after the updates");
+    }
+
+    for (size_t id = 0; id < scene.triangles.size(); ++id)
+    {
+        built.erase(id);
+    }
+    if (built.size() != 0 || built.getIntersectionsCounts() != std::vector<int>(scene.triangles.size(), 0))
+    {
+        fail(scene, "counts of the intersection scene after erasing all the triangles");
+    }
+
+    // the erased ids are reused, in any order
+    Task::IntersectionScene inserted;
+    bool is_inserted = true;
+    for (size_t i = 0; i < scene.triangles.size(); ++i)
+    {
+        is_inserted = is_inserted && inserted.insert(scene.triangles[i]) == i;
+    }
+    std::vector<size_t> ids;
+    for (const auto& tri : scene.triangles)
+    {
+        ids.push_back(built.insert(tri));
+    }
+    for (size_t i = 0; i < scene.triangles.size(); ++i)
+    {
+        is_inserted = is_inserted && ids[i] < scene.triangles.size() &&
+                built.getIntersectionsCount(ids[i]) == expected.count[i];
+    }
+    if (!is_inserted || inserted.getIntersectionsCounts() != expected.count)
+    {
+        fail(scene, "counts of the intersection scene filled by insert");
+    }
+}
+
+// the first half of a scene is indexed, the second half is the batch of the queries
+struct SplitScene
+{
+    std::vector<Triangle> set;
+    std::vector<Triangle> queries;
+    std::vector<int> count;     // numbers of the triangles of the set intersecting the queries
+    std::vector<int> set_count; // numbers of the queries intersecting the triangles of the set
+};
+
+SplitScene splitScene(const Scene& scene, const Expected& expected)
+{
+    const size_t half = scene.triangles.size() / 2;
+    SplitScene split;
+    split.set.assign(scene.triangles.begin(), scene.triangles.begin() + half);
+    split.queries.assign(scene.triangles.begin() + half, scene.triangles.end());
+    split.count.assign(split.queries.size(), 0);
+    split.set_count.assign(split.set.size(), 0);
+    for (size_t q = 0; q < split.queries.size(); ++q)
+    {
+        for (int j : expected.neighbours[half + q])
+        {
+            if (static_cast<size_t>(j) < half)
+            {
+                ++split.count[q];
+                ++split.set_count[j];
+            }
+        }
+    }
+    return split;
+}
+
+void checkIndex(const Scene& scene, const Expected& expected)
+{
+    const auto split = splitScene(scene, expected);
+    for (auto* pool : { &Task::WorkerPool::getDefault(), &getPool() })
+    {
+        Task::IntersectionIndex index(split.set, *pool);
+        // the index is built once for all the batches
+        for (int batch = 0; batch < 2; ++batch)
+        {
+            std::vector<int> count(1, -1);
+            index.countIntersections(split.queries, count);
+            if (index.size() != split.set.size() || count != split.count)
+            {
+                fail(scene, "counts of the queries of the index");
+            }
+        }
+
+        for (int max_count : max_counts)
+        {
+            std::vector<int> count(1, -1);
+            index.countIntersections(split.queries, count, max_count);
+            if (count != getCapped(split.count, max_count))
+            {
+                fail(scene, "counts up to " + std::to_string(max_count) + " of the queries of the index");
+            }
+        }
+
+        std::vector<int> count(1, -1);
+        std::vector<int> set_count(1, -1);
+        index.countIntersections(split.queries, count, set_count);
+        if (count != split.count || set_count != split.set_count)
+        {
+            fail(scene, "counts of the queries and the set of the index");
+        }
+    }
+
+    // the smaller set is indexed, so both orders are checked
+    std::vector<int> count_a(1, -1);
+    std::vector<int> count_b(1, -1);
+    Task::checkIntersections(split.set, split.queries, count_a, count_b);
+    if (count_a != split.set_count || count_b != split.count)
+    {
+        fail(scene, "counts of the two sets");
+    }
+    count_a.assign(1, -1);
+    count_b.assign(1, -1);
+    Task::checkIntersections(split.queries, split.set, count_a, count_b);
+    if (count_a != split.count || count_b != split.set_count)
+    {
+        fail(scene, "counts of the two sets in the other order");
+    }
+}
+
+// with no more samples than candidates the estimates are exact; with a few samples the sampling is faster,
+// the intervals must contain the exact numbers for most of the triangles
+void checkEstimates(const Scene& scene, const Expected& expected)
+{
+    std::vector<Task::CountEstimate> estimate(1, { -1.0f, -1.0f, -1.0f });
+    Task::estimateIntersections(scene.triangles, estimate);
+    bool is_exact = estimate.size() == expected.count.size();
+    for (size_t i = 0; is_exact && i < estimate.size(); ++i)
+    {
+        const float value = static_cast<float>(expected.count[i]);
+        is_exact = estimate[i].count == value && estimate[i].lower == value && estimate[i].upper == value;
+    }
+    if (!is_exact)
+    {
+        fail(scene, "estimates with the default number of the samples");
+    }
+
+    for (size_t samples_per_triangle : { 1, 4, 16 })
+    {
+        Task::estimateIntersections(scene.triangles, estimate, samples_per_triangle);
+        size_t inside_count = 0;
+        bool is_ordered = estimate.size() == expected.count.size();
+        for (size_t i = 0; is_ordered && i < estimate.size(); ++i)
+        {
+            const float value = static_cast<float>(expected.count[i]);
+            is_ordered = estimate[i].lower <= estimate[i].count && estimate[i].count <= estimate[i].upper;
+            inside_count += estimate[i].lower <= value && value <= estimate[i].upper ? 1 : 0;
+        }
+        if (!is_ordered || inside_count * 10 < estimate.size() * 9)
+        {
+            fail(scene, "estimates with " + std::to_string(samples_per_triangle) + " samples per triangle");
+        }
+    }
+}
+
+// a triangulated grid of width x height squares far from the origin, so the coordinates are rounded;
+// two triangles have a common point if and only if they share a vertex, whatever the engine
+void checkExactMesh()
+{
+    const int width = 40;
+    const int height = 30;
+    // the grid is rotated, so the sides are not along the axes and the shared vertices get rounded projections
+    auto getVertex = [](int x, int y)
+    {
+        return Point{ static_cast<float>(1000.3 + 0.8 * 0.1 * x - 0.6 * 0.1 * y),
+            static_cast<float>(2000.7 + 0.6 * 0.1 * x + 0.8 * 0.1 * y) };
+    };
+
+    Scene scene{ "mesh", {} };
+    std::vector<std::vector<int>> vertices_triangles((width + 1) * (height + 1));
+    auto add = [&](int x0, int y0, int x1, int y1, int x2, int y2)
+    {
+        const int i = static_cast<int>(scene.triangles.size());
+        scene.triangles.push_back({ getVertex(x0, y0), getVertex(x1, y1), getVertex(x2, y2) });
+        for (int vertex : { y0 * (width + 1) + x0, y1 * (width + 1) + x1, y2 * (width + 1) + x2 })
+        {
+            vertices_triangles[vertex].push_back(i);
+        }
+    };
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            // the diagonals alternate, so some of the vertices have 8 triangles around them and some have 4
+            if ((x + y) % 2 == 0)
+            {
+                add(x, y, x + 1, y, x + 1, y + 1);
+                add(x, y, x + 1, y + 1, x, y + 1);
+            }
+            else
+            {
+                add(x, y, x + 1, y, x, y + 1);
+                add(x + 1, y, x + 1, y + 1, x, y + 1);
+            }
+        }
+    }
+
+    std::vector<std::vector<int>> neighbours(scene.triangles.size());
+    for (const auto& around : vertices_triangles)
+    {
+        for (int i : around)
+        {
+            for (int j : around)
+            {
+                if (i != j)
+                {
+                    neighbours[i].push_back(j);
+                }
+            }
+        }
+    }
+    std::vector<int> expected;
+    for (auto& list : neighbours)
+    {
+        std::sort(list.begin(), list.end());
+        expected.push_back(static_cast<int>(std::unique(list.begin(), list.end()) - list.begin()));
+    }
+
+    for (auto engine : engines)
+    {
+        std::vector<int> count(1, -1);
+        Task::checkIntersectionsExactly(scene.triangles, count, engine);
+        if (count != expected)
+        {
+            fail(scene, std::string("exact counts of ") + getEngineName(engine));
+        }
+    }
+}
+
+// pairs of triangles on integer coordinates (exact in float) about 2^21 apart, a vertex of the second triangle
+// is next to the middle of a side of the first one: on it, or 1 / |side| on either side of it;
+// the cross products are about 2^43, so the float checks can't tell these apart, the exact check must
+void checkExactTouches()
+{
+    std::mt19937 random(5);
+    std::uniform_int_distribution<int64_t> coordinate(1 << 20, 1 << 21);
+    for (int test = 0; test < 300; ++test)
+    {
+        // side from (0, 0) to (2 * b_x, 2 * b_y) with coprime b_x, b_y and u, v such that b_x * v - b_y * u = 1
+        int64_t b_x = 0, b_y = 0, u = 0, v = 0;
+        for (int64_t g = 0; g != 1;)
+        {
+            b_x = coordinate(random);
+            b_y = coordinate(random);
+            // extended Euclid: old_r = old_s * b_x + old_t * b_y
+            int64_t old_r = b_x, r = b_y, old_s = 1, s = 0, old_t = 0, t = 1;
+            while (r != 0)
+            {
+                const int64_t q = old_r / r;
+                old_r -= q * r;
+                old_s -= q * s;
+                old_t -= q * t;
+                std::swap(old_r, r);
+                std::swap(old_s, s);
+                std::swap(old_t, t);
+            }
+            g = old_r;
+            // b_x * old_s + b_y * old_t = 1, the offset is moved along the side to stay near its middle
+            const int64_t k = old_t / b_x;
+            u = -(old_t - k * b_x);
+            v = old_s + k * b_y;
+        }
+
+        // the cross product of the side and the vertex is 2 * sign
+        const int sign = test % 3 - 1;
+        const int64_t p_x = b_x + sign * u;
+        const int64_t p_y = b_y + sign * v;
+        const int64_t d = 1 << 20;
+        auto point = [](int64_t x, int64_t y) { return Point{ static_cast<float>(x), static_cast<float>(y) }; };
+        const Triangle first{ point(0, 0), point(2 * b_x, 2 * b_y), point(0, 2 * b_y) };
+        const Triangle second{ point(p_x, p_y), point(p_x + d, p_y - d), point(p_x + 2 * d, p_y) };
+
+        const int expected = sign >= 0 ? 1 : 0;
+        for (const auto& triangles : { std::vector<Triangle>{ first, second }, std::vector<Triangle>{ second, first } })
+        {
+            std::vector<int> count(1, -1);
+            Task::checkIntersectionsExactly(triangles, count, Task::Engine::BruteForce);
+            if (count != std::vector<int>(2, expected))
+            {
+                fail({ "touches", triangles }, "exact counts of a vertex " + std::to_string(sign) + " from a side");
+            }
+
+            count.assign(1, -1);
+            Task::GridQuantization quantization;
+            if (!Task::checkIntersectionsOnGrid(triangles, count, quantization, Task::Engine::BruteForce) ||
+                count != std::vector<int>(2, expected) || quantization.bits != 32)
+            {
+                fail({ "touches", triangles },
+                    "counts on the grid of a vertex " + std::to_string(sign) + " from a side");
+            }
+        }
+    }
+}
+
+// the narrow kernels on the grid are the float ones, the wide ones have no sse4.1 variant
+bool isOnGridKernel(const Task::GridQuantization& quantization)
+{
+    const std::string kernel = Task::getPairKernelName();
+    return quantization.kernel == kernel ||
+        (quantization.bits == 32 && kernel == "sse4.1" && std::string(quantization.kernel) == "scalar");
+}
+
+// the coordinates are snapped to a 1/64 grid, so many pairs touch exactly; the counts on the grid must be
+// the exact ones, in the narrow integers and in the wide ones (with a far triangle, which widens the range
+// of a scene which isn't empty)
+void checkOnGrid(const Scene& scene)
+{
+    Scene snapped{ scene.name, scene.triangles };
+    for (auto& tri : snapped.triangles)
+    {
+        for (Point* point : { &tri.a, &tri.b, &tri.c })
+        {
+            point->x = std::round(point->x * 64) / 64;
+            point->y = std::round(point->y * 64) / 64;
+        }
+    }
+
+    for (int bits : { 16, 32 })
+    {
+        if (bits == 32)
+        {
+            snapped.triangles.push_back({ { 1e6f, 1e6f }, { 1e6f + 1, 1e6f }, { 1e6f, 1e6f + 1 } });
+        }
+        std::vector<int> expected;
+        Task::checkIntersectionsExactly(snapped.triangles, expected, Task::Engine::BruteForce);
+        for (auto engine : engines)
+        {
+            std::vector<int> count(1, -1);
+            Task::GridQuantization quantization;
+            const bool is_checked = Task::checkIntersectionsOnGrid(snapped.triangles, count, quantization, engine);
+            if (!is_checked || count != expected || (!scene.triangles.empty() && quantization.bits != bits) ||
+                !isOnGridKernel(quantization))
+            {
+                fail(snapped, "counts on the grid of " + std::to_string(bits) + " bits of " + getEngineName(engine));
+            }
+        }
+    }
+}
+
+// the coordinates which can't be mapped to int32 are refused
+void checkOffGrid()
+{
+    const Point nan{ std::numeric_limits<float>::quiet_NaN(), 0 };
+    const Scene scenes[] = {
+        { "not a number", { { { 0, 0 }, { 1, 0 }, nan } } },
+        { "too wide", { { { 0.5f, 0 }, { 1, 0 }, { 0, 1 } }, { { 1e10f, 0 }, { 1e10f, 1 }, { 1e10f + 1e4f, 0 } } } },
+    };
+    for (const auto& scene : scenes)
+    {
+        std::vector<int> count;
+        Task::GridQuantization quantization;
+        if (Task::checkIntersectionsOnGrid(scene.triangles, count, quantization))
+        {
+            fail(scene, "check on the grid of the coordinates out of int32");
+        }
+    }
+}
+
+// every triangle moved by its own small offset, as in the next frame of a simulation
+std::vector<Triangle> getMovedTriangles(const std::vector<Triangle>& triangles, size_t frame)
+{
+    std::vector<Triangle> moved(triangles);
+    for (size_t i = 0; i < moved.size(); ++i)
+    {
+        const float dx = static_cast<float>(static_cast<int>((i * 7 + frame) % 11) - 5) * 0.01f;
+        const float dy = static_cast<float>(static_cast<int>((i * 3 + frame) % 7) - 3) * 0.01f;
+        for (Point* point : { &moved[i].a, &moved[i].b, &moved[i].c })
+        {
+            point->x += dx;
+            point->y += dy;
+        }
+    }
+    return moved;
+}
+
+// one state goes through all the scenes and back to the empty one, so the number of the triangles changes
+// every time; every scene is checked twice as it is and once moved, reusing the sweep of the previous frame
+void checkCoherence(const std::vector<Scene>& scenes, const std::vector<Expected>& expected)
+{
+    Task::CoherenceState state;
+    for (size_t i = 0; i <= scenes.size(); ++i)
+    {
+        const auto& scene = scenes[i % scenes.size()];
+        const auto& scene_expected = expected[i % scenes.size()];
+        for (int frame = 0; frame < 2; ++frame)
+        {
+            std::vector<int> count(1, -1);
+            Task::Stats stats;
+            Task::checkIntersections(scene.triangles, count, state, stats);
+            // the first frame has nothing to reuse, the number of the triangles changed
+            const bool is_from_scratch = frame > 0 || stats.pairs.skipped_by_cached_side == 0;
+            if (count != scene_expected.count || !areStatsOf(stats, count) || !is_from_scratch)
+            {
+                fail(scene, "counts of frame " + std::to_string(frame) + " with the coherence state");
+            }
+        }
+
+        const auto moved = getMovedTriangles(scene.triangles, i);
+        std::vector<int> moved_expected;
+        Task::checkIntersections(moved, moved_expected, Task::Engine::BruteForce);
+        std::vector<int> count(1, -1);
+        Task::checkIntersections(moved, count, state);
+        if (count != moved_expected)
+        {
+            fail(scene, "counts of the moved triangles with the coherence state");
+        }
+    }
+
+    // the last frame was empty, so the next one starts from scratch, as well as the one after the reset
+    for (int frame = 0; frame < 2; ++frame)
+    {
+        if (frame > 0)
+        {
+            state.reset();
+        }
+        std::vector<int> count(1, -1);
+        Task::Stats stats;
+        Task::checkIntersections(scenes.back().triangles, count, state, stats);
+        if (count != expected.back().count || stats.pairs.skipped_by_cached_side != 0)
+        {
+            fail(scenes.back(), frame > 0 ? "counts after the reset of the coherence state" :
+                                            "counts after an empty frame with the coherence state");
+        }
+    }
+}
+
+// the pairs of the brute force, the numbers of the intersections are the sizes of the lists
+bool save(const char* path)
+{
+    std::ofstream out(path);
+    for (const auto& scene : makeScenes())
+    {
+        std::vector<int> count;
+        Task::checkIntersections(scene.triangles, count, Task::Engine::BruteForce);
+        Task::Adjacency adjacency;
+        Task::checkIntersections(scene.triangles, adjacency, Task::Engine::BruteForce);
+
+        Expected expected;
+        for (size_t i = 0; i < count.size(); ++i)
+        {
+            expected.neighbours.emplace_back(adjacency.neighbours.begin() + adjacency.offsets[i],
+                adjacency.neighbours.begin() + adjacency.offsets[i + 1]);
+            expected.count.push_back(static_cast<int>(expected.neighbours.back().size()));
+        }
+        if (expected.count != count || !isSymmetric(expected.neighbours) || !isAdjacencyOf(adjacency, expected))
+        {
+            fail(scene, "pairs of brute force");
+            return false;
+        }
+
+        out << scene.name << ' ' << count.size();
+        for (const auto& list : expected.neighbours)
+        {
+            out << ' ' << list.size();
+            for (int j : list)
+            {
+                out << ' ' << j;
+            }
+        }
+        out << '\n';
+    }
+    return static_cast<bool>(out);
+}
+
+bool load(std::istream& in, const Scene& scene, Expected& expected)
+{
+    std::string name;
+    size_t size = 0;
+    in >> name >> size;
+    expected.count.resize(size);
+    expected.neighbours.resize(size);
+    for (size_t i = 0; i < size && in; ++i)
+    {
+        in >> expected.count[i];
+        expected.neighbours[i].resize(static_cast<size_t>(std::max(expected.count[i], 0)));
+        for (int& j : expected.neighbours[i])
+        {
+            in >> j;
+        }
+    }
+    expected.component = getComponents(expected.neighbours);
+    return in && name == scene.name;
+}
+
+bool compare(const char* path)
+{
+    std::ifstream in(path);
+    const auto scenes = makeScenes();
+    std::vector<Expected> expected(scenes.size());
+    for (size_t i = 0; i < scenes.size(); ++i)
+    {
+        if (!load(in, scenes[i], expected[i]))
+        {
+            fail(scenes[i], "no saved numbers");
+            return false;
+        }
+        checkEngines(scenes[i], expected[i]);
+        checkIntersectionScene(scenes[i], expected[i]);
+        checkIndex(scenes[i], expected[i]);
+        checkEstimates(scenes[i], expected[i]);
+        checkOnGrid(scenes[i]);
+    }
+    checkCoherence(scenes, expected);
+    checkExactMesh();
+    checkExactTouches();
+    checkOffGrid();
+    return is_passed;
+}
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc == 3 && std::strcmp(argv[1], "--save") == 0)
+    {
+        return save(argv[2]) ? 0 : 1;
+    }
+    if (argc == 3 && std::strcmp(argv[1], "--compare") == 0)
+    {
+        return compare(argv[2]) ? 0 : 1;
+    }
+    std::printf("usage: %s --save <file> | --compare <file>\n", argv[0]);
+    return 1;
+}